@@ -0,0 +1,398 @@
+/*
+ * Copyright (c) 2025 Tobias Stoeckmann <tobias@stoeckmann.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <xcb/xcb.h>
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "functions.h"
+
+/* temporary files of aborted writes are removed after a day */
+#define TMP_PREFIX	".tmp-"
+#define TMP_MAX_AGE	(24 * 60 * 60)
+
+typedef struct wp_entry {
+	char		name[NAME_MAX + 1];
+	struct timespec	mtime;
+	off_t		size;
+} wp_entry_t;
+
+static int dir_fd = -1;
+static size_t hits, misses;
+
+static void
+get_name(wp_cache_t *cache)
+{
+	uint64_t hash;
+	uint8_t *p;
+	size_t i;
+
+	/* FNV-1a, collisions are detected through stored keys */
+	hash = UINT64_C(0xcbf29ce484222325);
+	p = (uint8_t *)cache->header.key;
+	for (i = 0; i < sizeof(cache->header.key); i++) {
+		hash ^= p[i];
+		hash *= UINT64_C(0x100000001b3);
+	}
+	snprintf(cache->name, sizeof(cache->name), "%016" PRIx64, hash);
+}
+
+static int
+mkdir_p(char *path)
+{
+	char *p;
+
+	for (p = path + 1; *p != '\0'; p++) {
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		if (mkdir(path, 0700) && errno != EEXIST) {
+			*p = '/';
+			return 1;
+		}
+		*p = '/';
+	}
+	return mkdir(path, 0700) && errno != EEXIST;
+}
+
+/*
+ * Opens the cache directory.  Has to be called before the sandbox is
+ * tightened, entries are accessed relative to the directory later on.
+ * Returns the descriptor of the directory, or -1 if it is unavailable.
+ */
+int
+init_cache(void)
+{
+	const char *base, *sub;
+	char path[PATH_MAX];
+	int len;
+
+	if ((base = getenv("XDG_CACHE_HOME")) != NULL && *base == '/')
+		sub = "xwallpaper";
+	else if ((base = getenv("HOME")) != NULL && *base == '/')
+		sub = ".cache/xwallpaper";
+	else {
+		warnx("no cache directory found, disabling cache");
+		return -1;
+	}
+
+	len = snprintf(path, sizeof(path), "%s/%s", base, sub);
+	if (len < 0 || (size_t)len >= sizeof(path)) {
+		warnx("cache directory path too long, disabling cache");
+		return -1;
+	}
+
+	if (mkdir_p(path) || (dir_fd = open(path,
+	    O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+		warn("failed to open cache directory %s, disabling cache",
+		    path);
+		return -1;
+	}
+
+	debug("using cache directory %s\n", path);
+
+	return dir_fd;
+}
+
+static int
+compare_entries(const void *a, const void *b)
+{
+	const wp_entry_t *x = a, *y = b;
+
+	if (x->mtime.tv_sec != y->mtime.tv_sec)
+		return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+	if (x->mtime.tv_nsec != y->mtime.tv_nsec)
+		return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : 1;
+	return 0;
+}
+
+static void
+evict_cache(void)
+{
+	DIR *dir;
+	struct dirent *dp;
+	struct stat st;
+	wp_entry_t *entries;
+	uint64_t limit, total;
+	size_t count, i, len;
+	time_t now;
+	int fd;
+
+	if ((fd = dup(dir_fd)) == -1 || (dir = fdopendir(fd)) == NULL) {
+		if (fd != -1)
+			close(fd);
+		return;
+	}
+	rewinddir(dir);
+
+	entries = NULL;
+	count = 0;
+	total = 0;
+	now = time(NULL);
+	while ((dp = readdir(dir)) != NULL) {
+		if (fstatat(dir_fd, dp->d_name, &st, AT_SYMLINK_NOFOLLOW) ||
+		    !S_ISREG(st.st_mode))
+			continue;
+		/* still being written, or left behind by an aborted run */
+		if (strncmp(dp->d_name, TMP_PREFIX,
+		    sizeof(TMP_PREFIX) - 1) == 0) {
+			if (now - st.st_mtim.tv_sec > TMP_MAX_AGE) {
+				debug("removing stale %s\n", dp->d_name);
+				unlinkat(dir_fd, dp->d_name, 0);
+			}
+			continue;
+		}
+		SAFE_MUL(len, count + 1, sizeof(*entries));
+		entries = realloc(entries, len);
+		if (entries == NULL)
+			err(1, "failed to allocate memory");
+		snprintf(entries[count].name, sizeof(entries[count].name),
+		    "%s", dp->d_name);
+		entries[count].mtime = st.st_mtim;
+		entries[count].size = st.st_size;
+		total += st.st_size;
+		count++;
+	}
+	closedir(dir);
+
+	limit = (uint64_t)CACHE_SIZE << 20;
+	if (total > limit) {
+		qsort(entries, count, sizeof(*entries), compare_entries);
+		for (i = 0; i < count && total > limit; i++) {
+			debug("evicting cache entry %s\n", entries[i].name);
+			if (unlinkat(dir_fd, entries[i].name, 0) == 0)
+				total -= entries[i].size;
+		}
+	}
+	free(entries);
+}
+
+/*
+ * Stores the decoding of an image in key of entry, because pixels
+ * depend on the scaling denominator and the decoded region.
+ */
+static void
+set_decode(wp_cache_t *cache, unsigned int denom, wp_box_t *region)
+{
+	cache->header.key[8] = denom;
+	cache->header.key[9] = (uint64_t)region->width << 48 |
+	    (uint64_t)region->height << 32 |
+	    (uint64_t)region->x_off << 16 | region->y_off;
+	get_name(cache);
+}
+
+/*
+ * Looks up composed pixels of a job.  Returns NULL if job cannot be
+ * cached, otherwise pixels is set if an entry was found.
+ */
+wp_cache_t *
+lookup_cache(xcb_screen_t *screen, wp_job_t *job)
+{
+	wp_cache_t *cache;
+	wp_buffer_t *buffer;
+	wp_box_t region, *trim;
+	struct stat st;
+	size_t stride;
+	unsigned int denom, target;
+	int fd;
+
+	/* tiles of outputs are uploaded once and filled by the server */
+	if (dir_fd == -1 || job->output == NULL ||
+	    job->option->mode == MODE_TILE)
+		return NULL;
+
+	/* same layout as composed outputs */
+	SAFE_MUL(stride, job->output->width, screen->root_depth == 16 ? 2 : 4);
+	stride = (stride + 3) & ~(size_t)3;
+
+	buffer = job->option->buffer;
+	trim = job->option->trim;
+	cache = xmalloc(sizeof(*cache));
+	*cache = (wp_cache_t){
+		.header = {
+			.magic = RAW_MAGIC,
+			.format = get_format(screen),
+			.width = job->output->width,
+			.height = job->output->height,
+			.stride = stride,
+			.offset = RAW_ALIGN,
+			.key = {
+				buffer->st_dev,
+				buffer->st_ino,
+				buffer->st_size,
+				buffer->st_mtim.tv_sec,
+				buffer->st_mtim.tv_nsec,
+				(uint64_t)CACHE_VERSION << 32 |
+				    job->option->mode,
+				trim == NULL ? 0 :
+				    (uint64_t)trim->width << 48 |
+				    (uint64_t)trim->height << 32 |
+				    (uint64_t)trim->x_off << 16 | trim->y_off,
+				(uint64_t)job->output->width << 32 |
+				    (uint64_t)job->output->height << 16 |
+				    screen->root_depth
+			}
+		},
+		.buffer = buffer,
+		.fd = -1,
+		.total = stride * job->output->height
+	};
+
+	/* as decoded by load_pixman_images, halving needs 8 bit channels */
+	denom = get_scale_denom(buffer);
+	target = get_reduce_denom(buffer);
+	get_region(buffer, denom, &region);
+	if (buffer->info.format != FORMAT_RAW || buffer->info.depth == 24 ||
+	    buffer->info.depth == 32)
+		for (; denom < target; denom *= 2)
+			halve_region(&region);
+	set_decode(cache, denom, &region);
+
+	if ((fd = openat(dir_fd, cache->name, O_RDONLY | O_CLOEXEC)) == -1)
+		goto miss;
+	/* entries are raw images with a key */
+	if (fstat(fd, &st) ||
+	    (uintmax_t)st.st_size != RAW_ALIGN + (uintmax_t)cache->total) {
+		close(fd);
+		goto miss;
+	}
+	cache->len = st.st_size;
+	cache->map = mmap(NULL, cache->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (cache->map == MAP_FAILED) {
+		cache->map = NULL;
+		close(fd);
+		goto miss;
+	}
+	close(fd);
+	/* touch entry for eviction order */
+	utimensat(dir_fd, cache->name, NULL, AT_SYMLINK_NOFOLLOW);
+
+	if (memcmp(cache->map, &cache->header, sizeof(cache->header)) != 0) {
+		munmap(cache->map, cache->len);
+		cache->map = NULL;
+		goto miss;
+	}
+
+	cache->pixels = cache->map + RAW_ALIGN;
+	hits++;
+	debug("cache hit %s for %s on %s (%zu hits, %zu misses)\n",
+	    cache->name, job->option->filename, job->output->name != NULL ?
+	    job->output->name : "screen", hits, misses);
+	return cache;
+miss:
+	misses++;
+	debug("cache miss %s for %s on %s (%zu hits, %zu misses)\n",
+	    cache->name, job->option->filename, job->output->name != NULL ?
+	    job->output->name : "screen", hits, misses);
+	return cache;
+}
+
+static int
+write_all(int fd, const void *data, size_t len)
+{
+	const uint8_t *p;
+	ssize_t n;
+
+	for (p = data; len > 0; p += n, len -= n)
+		if ((n = write(fd, p, len)) == -1) {
+			if (errno != EINTR)
+				return 1;
+			n = 0;
+		}
+	return 0;
+}
+
+/*
+ * Appends composed pixels to a new entry.  The entry is written to a
+ * temporary file which is only renamed when complete.
+ */
+void
+write_cache(wp_cache_t *cache, const uint8_t *data, size_t len)
+{
+	uint8_t header[RAW_ALIGN];
+
+	if (cache->pixels != NULL || cache->failed)
+		return;
+
+	if (cache->fd == -1) {
+		/* decoding was only predicted by lookup */
+		set_decode(cache, cache->buffer->denom,
+		    &cache->buffer->region);
+		snprintf(cache->tmp, sizeof(cache->tmp), TMP_PREFIX "%ld-%s",
+		    (long)getpid(), cache->name);
+		cache->fd = openat(dir_fd, cache->tmp,
+		    O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+		if (cache->fd == -1) {
+			cache->failed = 1;
+			return;
+		}
+		memset(header, 0, sizeof(header));
+		memcpy(header, &cache->header, sizeof(cache->header));
+		if (write_all(cache->fd, header, sizeof(header))) {
+			cache->failed = 1;
+			return;
+		}
+	}
+
+	if (write_all(cache->fd, data, len))
+		cache->failed = 1;
+	cache->written += len;
+}
+
+/*
+ * Releases a cache lookup.  A new entry is stored if all of its pixels
+ * have been written.
+ */
+void
+close_cache(wp_cache_t *cache)
+{
+	if (cache == NULL)
+		return;
+
+	if (cache->map != NULL)
+		munmap(cache->map, cache->len);
+
+	if (cache->fd != -1) {
+		if (close(cache->fd) || cache->failed ||
+		    cache->written != cache->total ||
+		    renameat(dir_fd, cache->tmp, dir_fd, cache->name)) {
+			debug("failed to write cache entry %s\n", cache->name);
+			unlinkat(dir_fd, cache->tmp, 0);
+		} else {
+			debug("wrote cache entry %s\n", cache->name);
+			evict_cache();
+		}
+	}
+
+	free(cache);
+}
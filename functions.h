@@ -33,6 +33,41 @@
 #define MODE_TILE	5
 #define MODE_ZOOM	6
 
+#define FORMAT_JPEG	1
+#define FORMAT_PNG	2
+#define FORMAT_XPM	3
+#define FORMAT_RAW	4
+
+/* refuse to decode more pixels, i.e. 2 GB of memory */
+#define PIXEL_BUDGET	(UINT32_C(1) << 29)
+
+/* largest reduction of images before they are transformed */
+#define MAX_DENOM	64
+
+/* source pixels per scale factor reached by Lanczos filters */
+#define LANCZOS_RADIUS	3
+
+/* milliseconds without RandR events until the layout is drawn */
+#define SETTLE_DELAY	200
+
+/* pixmaps of previous layouts kept by the daemon, in number and MB */
+#define LAYOUT_COUNT	4
+#define LAYOUT_MEMORY	256
+
+/* upper limit of automatically detected threads */
+#define MAX_THREADS	64
+
+/* cache size in MB, least recently used entries are evicted beyond */
+#define CACHE_SIZE	512
+
+#define CACHE_KEY_LEN	10
+/* increased whenever composed pixels change, invalidating old entries */
+#define CACHE_VERSION	6
+
+/* raw images: header, zero padding, pixels at offset */
+#define RAW_MAGIC	"XWPRAW1\n"
+#define RAW_ALIGN	4096
+
 #define SOURCE_ATOMS	1
 
 #define TARGET_ATOMS	1
@@ -56,11 +91,37 @@ typedef struct wp_box {
 	uint16_t	y_off;
 } wp_box_t;
 
+typedef struct wp_target {
+	uint16_t	 width;
+	uint16_t	 height;
+	int		 mode;
+	wp_box_t	*trim;
+} wp_target_t;
+
+typedef struct wp_info {
+	int		 format;
+	uint32_t	 width;
+	uint32_t	 height;
+	int		 depth;
+	int		 alpha;
+	int		 interlaced;
+} wp_info_t;
+
 typedef struct wp_buffer {
-	FILE		*fp;
+	/* contents of file, always followed by a NUL byte */
+	uint8_t		*data;
+	size_t		 len;
+	int		 mapped;
 	pixman_image_t	*pixman_image;
 	dev_t		 st_dev;
 	ino_t		 st_ino;
+	off_t		 st_size;
+	struct timespec	 st_mtim;
+	wp_info_t	 info;
+	unsigned int	 denom;
+	wp_box_t	 region;
+	wp_target_t	*targets;
+	size_t		 count;
 } wp_buffer_t;
 
 typedef struct wp_option {
@@ -78,25 +139,132 @@ typedef struct wp_config {
 	int		 daemon;
 	int		 source;
 	int		 target;
+	unsigned int	 threads;
+	int		 cache;
+	int		 settle;
+	size_t		 layouts;
+	size_t		 layout_memory;
 } wp_config_t;
 
 typedef struct wp_output {
 	char *name;
+	/* names of cloned or tiled outputs shown by this one */
+	char **aliases;
 	int16_t x, y;
 	uint16_t width, height;
+	/* previous wallpaper is still valid, located at old_x, old_y */
+	int keep;
+	int16_t old_x, old_y;
 } wp_output_t;
 
+/*
+ * Header of raw images.  All fields are in native byte order, pixels
+ * are stored in rows of stride bytes starting at offset, which is a
+ * multiple of RAW_ALIGN.  Key is only used by cache entries.
+ */
+typedef struct wp_raw {
+	char		 magic[8];
+	uint32_t	 format;
+	uint32_t	 width;
+	uint32_t	 height;
+	uint32_t	 stride;
+	uint64_t	 offset;
+	uint64_t	 key[CACHE_KEY_LEN];
+} wp_raw_t;
+
+typedef struct wp_cache {
+	/* expected header of entry */
+	wp_raw_t	 header;
+	char		 name[17];
+	/* mapped entry, pixels point into it on cache hit */
+	uint8_t		*map;
+	size_t		 len;
+	uint8_t		*pixels;
+	/* new entry on cache miss, keyed by decoding of buffer */
+	wp_buffer_t	*buffer;
+	char		 tmp[64];
+	int		 fd;
+	int		 failed;
+	size_t		 written;
+	size_t		 total;
+} wp_cache_t;
+
+typedef struct wp_job {
+	wp_option_t	*option;
+	wp_output_t	*output;
+	wp_cache_t	*cache;
+} wp_job_t;
+
+typedef struct wp_plan {
+	wp_output_t	*outputs;
+	wp_job_t	*jobs;
+	size_t		 count;
+	/* shows the wallpaper in daemon mode, for reuse on next event */
+	xcb_pixmap_t	 pixmap;
+} wp_plan_t;
+
 extern int	 has_randr;
 extern int	 show_debug;
 
+void		 add_layout(xcb_connection_t *, xcb_screen_t *, int,
+		    wp_config_t *, wp_plan_t *);
+void		 close_cache(wp_cache_t *);
+uint32_t	 create_picture(xcb_connection_t *, xcb_pixmap_t);
+void		*create_shm(xcb_connection_t *, size_t, uint32_t *);
 void		 debug(const char *, ...);
+xcb_pixmap_t	 find_layout(xcb_screen_t *, int, wp_plan_t *);
 void		 free_outputs(wp_output_t *);
+void		 free_picture(xcb_connection_t *, uint32_t);
+void		 free_pixels(pixman_image_t *, void *);
+void		 free_plan(wp_plan_t *);
+void		 free_shm(xcb_connection_t *, void *, size_t, uint32_t);
+pixman_format_code_t get_format(xcb_screen_t *);
 wp_output_t	*get_output(wp_output_t *, char *);
 wp_output_t	*get_outputs(xcb_connection_t *, xcb_screen_t *);
-pixman_image_t	*load_jpeg(FILE *);
-pixman_image_t	*load_png(FILE *);
-pixman_image_t	*load_xpm(xcb_connection_t *, xcb_screen_t *, FILE *);
+void		 get_region(wp_buffer_t *, unsigned int, wp_box_t *);
+unsigned int	 get_reduce_denom(wp_buffer_t *);
+unsigned int	 get_scale_denom(wp_buffer_t *);
+unsigned int	 get_threads(void);
+void		 get_transform(wp_target_t *, wp_info_t *,
+		    pixman_f_transform_t *, int);
+pixman_image_t	*halve_image(pixman_image_t *, wp_box_t *);
+void		 halve_region(wp_box_t *);
+int		 init_cache(void);
+int		 init_render(xcb_connection_t *, xcb_screen_t *);
+void		 init_threads(unsigned int);
+int		 is_layout(xcb_pixmap_t);
+void		 keep_outputs(wp_plan_t *, wp_plan_t *);
+pixman_image_t	*load_jpeg(const uint8_t *, size_t, unsigned int, wp_box_t *);
+pixman_image_t	*load_png(const uint8_t *, size_t, unsigned int, wp_box_t *);
+pixman_image_t	*load_raw(const uint8_t *, size_t);
+pixman_image_t	*load_xpm(xcb_connection_t *, xcb_screen_t *, const uint8_t *,
+		    size_t);
+wp_cache_t	*lookup_cache(xcb_screen_t *, wp_job_t *);
+void		 map_buffer(wp_buffer_t *, int, const char *);
 wp_config_t	*parse_config(char **);
+void		 plan_buffers(wp_config_t *, wp_plan_t *, size_t);
+void		 plan_cache(xcb_screen_t *, wp_plan_t *);
+void		 plan_screen(xcb_connection_t *, xcb_screen_t *, int,
+		    wp_config_t *, wp_plan_t *);
+int		 probe_jpeg(const uint8_t *, size_t, wp_info_t *);
+int		 probe_png(const uint8_t *, size_t, wp_info_t *);
+int		 probe_raw(const uint8_t *, size_t, wp_info_t *);
+int		 probe_xpm(const uint8_t *, size_t, wp_info_t *);
+void		 put_shm(xcb_connection_t *, xcb_screen_t *, wp_output_t *,
+		    xcb_pixmap_t, xcb_gcontext_t, uint32_t);
+void		 release_tasks(size_t);
+void		 run_tasks(void (*)(void *, size_t), void *, size_t);
+void		 scale_band(pixman_image_t *, int, pixman_image_t *, int, int,
+		    int, int, int);
+void		 scale_picture(xcb_connection_t *, xcb_screen_t *, uint32_t,
+		    xcb_pixmap_t, wp_output_t *, wp_output_t *,
+		    pixman_transform_t *, pixman_filter_t);
 void		 stage1_sandbox(void);
-void		 stage2_sandbox(void);
+void		 stage2_sandbox(int);
+void		 start_tasks(void (*)(void *, size_t), void *, size_t,
+		    size_t);
+void		 unmap_buffer(wp_buffer_t *);
+void		 wait_tasks(size_t);
+void		 write_cache(wp_cache_t *, const uint8_t *, size_t);
+int		 write_raw(FILE *, pixman_image_t *);
 void		*xmalloc(size_t);
@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2025 Tobias Stoeckmann <tobias@stoeckmann.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <xcb/xcb.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "functions.h"
+
+/*
+ * Pixmaps of previously shown layouts, kept on the X server in daemon
+ * mode.  Returning to a layout shows its pixmap again without drawing.
+ */
+typedef struct wp_layout {
+	char		*key;
+	xcb_pixmap_t	 pixmap;
+	size_t		 size;
+	int		 snum;
+	unsigned long	 used;
+} wp_layout_t;
+
+static wp_layout_t *layouts;
+static size_t count, total;
+static unsigned long tick;
+
+/*
+ * Describes everything that affects the wallpaper of a screen, i.e.
+ * its size, depth and the geometry of all outputs.
+ */
+static char *
+get_key(xcb_screen_t *screen, int snum, wp_plan_t *plan)
+{
+	wp_output_t *output;
+	char *key;
+	size_t len, n;
+
+	len = 64;
+	for (output = plan->outputs; output != NULL && output->name != NULL;
+	    output++) {
+		if (SIZE_MAX - len < strlen(output->name) + 64)
+			errx(1, "layout key would exceed system limits");
+		len += strlen(output->name) + 64;
+	}
+
+	key = xmalloc(len);
+	n = snprintf(key, len, "%d %ux%u %u", snum, screen->width_in_pixels,
+	    screen->height_in_pixels, screen->root_depth);
+	for (output = plan->outputs; output != NULL && output->name != NULL;
+	    output++)
+		n += snprintf(key + n, len - n, " %s %ux%u%+d%+d",
+		    output->name, output->width, output->height, output->x,
+		    output->y);
+
+	return key;
+}
+
+static void
+remove_layout(xcb_connection_t *c, wp_plan_t *plans, size_t i)
+{
+	wp_layout_t *layout;
+
+	layout = &layouts[i];
+	/* shown pixmaps are released when they are replaced */
+	if (plans[layout->snum].pixmap != layout->pixmap)
+		xcb_free_pixmap(c, layout->pixmap);
+	debug("removing layout %s\n", layout->key);
+	free(layout->key);
+	total -= layout->size;
+	layouts[i] = layouts[--count];
+}
+
+/*
+ * Returns pixmap of the layout planned for screen or
+ * XCB_BACK_PIXMAP_NONE if it has not been seen before.
+ */
+xcb_pixmap_t
+find_layout(xcb_screen_t *screen, int snum, wp_plan_t *plan)
+{
+	char *key;
+	size_t i;
+
+	if (count == 0)
+		return XCB_BACK_PIXMAP_NONE;
+
+	key = get_key(screen, snum, plan);
+	for (i = 0; i < count; i++)
+		if (strcmp(layouts[i].key, key) == 0)
+			break;
+	free(key);
+	if (i == count)
+		return XCB_BACK_PIXMAP_NONE;
+
+	layouts[i].used = ++tick;
+	debug("found pixmap of layout %s\n", layouts[i].key);
+	return layouts[i].pixmap;
+}
+
+/*
+ * Remembers pixmap of screen which has just been drawn.  Least recently
+ * used layouts are removed if limits are exceeded.
+ */
+void
+add_layout(xcb_connection_t *c, xcb_screen_t *screen, int snum,
+    wp_config_t *config, wp_plan_t *plans)
+{
+	wp_layout_t *layout;
+	size_t i, len, lru;
+
+	if (config->layouts == 0 ||
+	    plans[snum].pixmap == XCB_BACK_PIXMAP_NONE)
+		return;
+
+	SAFE_MUL(len, count + 1, sizeof(*layouts));
+	layouts = realloc(layouts, len);
+	if (layouts == NULL)
+		err(1, "failed to allocate memory");
+	layout = &layouts[count++];
+	layout->key = get_key(screen, snum, &plans[snum]);
+	layout->pixmap = plans[snum].pixmap;
+	SAFE_MUL3(layout->size, (size_t)screen->width_in_pixels,
+	    screen->height_in_pixels, screen->root_depth == 16 ? 2 : 4);
+	layout->snum = snum;
+	layout->used = ++tick;
+	total += layout->size;
+	debug("adding layout %s\n", layout->key);
+
+	/* a previous entry of this layout has been replaced */
+	for (i = 0; i < count - 1; i++)
+		if (strcmp(layouts[i].key, layout->key) == 0) {
+			remove_layout(c, plans, i);
+			break;
+		}
+
+	while (count > config->layouts || total > config->layout_memory) {
+		lru = 0;
+		for (i = 1; i < count; i++)
+			if (layouts[i].used < layouts[lru].used)
+				lru = i;
+		remove_layout(c, plans, lru);
+	}
+}
+
+/*
+ * Returns 1 if pixmap belongs to a remembered layout, which must neither
+ * be freed nor drawn into.
+ */
+int
+is_layout(xcb_pixmap_t pixmap)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		if (layouts[i].pixmap == pixmap)
+			return 1;
+	return 0;
+}
@@ -41,12 +41,47 @@ error_jpg(j_common_ptr common)
 	longjmp(wp_err->env, 1);
 }
 
+static int
+do_probe_jpeg(const uint8_t *data, size_t len,
+    struct jpeg_decompress_struct *cinfo, wp_info_t *info)
+{
+	wp_err_t wp_err;
+
+	cinfo->err = jpeg_std_error(&wp_err.mgr);
+	wp_err.mgr.error_exit = error_jpg;
+
+	if (setjmp(wp_err.env)) {
+		debug("failed to parse JPEG header\n");
+		jpeg_destroy_decompress(cinfo);
+		return 1;
+	}
+
+	jpeg_create_decompress(cinfo);
+	/* older versions of libjpeg lack const, data is only read */
+	jpeg_mem_src(cinfo, (unsigned char *)data, len);
+	jpeg_read_header(cinfo, TRUE);
+
+	*info = (wp_info_t){
+		.format = FORMAT_JPEG,
+		.width = cinfo->image_width,
+		.height = cinfo->image_height,
+		.depth = cinfo->data_precision,
+		.alpha = 0,
+		.interlaced = cinfo->progressive_mode
+	};
+
+	jpeg_destroy_decompress(cinfo);
+
+	return 0;
+}
+
 static pixman_image_t *
-do_load_jpeg(FILE *fp, struct jpeg_decompress_struct *cinfo, uint32_t **pixels)
+do_load_jpeg(const uint8_t *data, size_t size, unsigned int denom,
+    wp_box_t *region, struct jpeg_decompress_struct *cinfo, uint32_t **pixels)
 {
 	wp_err_t wp_err;
 	pixman_image_t *img;
-	JDIMENSION y, width, height;
+	JDIMENSION x_off, y, width, height;
 	uint32_t *p;
 	size_t len;
 
@@ -60,46 +95,86 @@ do_load_jpeg(FILE *fp, struct jpeg_decompress_struct *cinfo, uint32_t **pixels)
 	}
 
 	jpeg_create_decompress(cinfo);
-	jpeg_stdio_src(cinfo, fp);
+	jpeg_mem_src(cinfo, (unsigned char *)data, size);
 	jpeg_read_header(cinfo, TRUE);
 
-	width = cinfo->image_width;
-	height = cinfo->image_height;
 	cinfo->out_color_space = JCS_EXT_BGRA;
+	cinfo->scale_num = 1;
+	cinfo->scale_denom = denom;
 
 	jpeg_start_decompress(cinfo);
 
-	SAFE_MUL3(len, width, height, sizeof(**pixels));
-	p = *pixels = xmalloc(len);
+	if (cinfo->scale_denom != 1)
+		debug("decoding JPEG (%ux%u) at 1/%u scale (%ux%u)\n",
+		    cinfo->image_width, cinfo->image_height,
+		    cinfo->scale_denom, cinfo->output_width,
+		    cinfo->output_height);
 
-	if (cinfo->output_components != 4)
+	if (cinfo->output_components != 4 ||
+	    region->x_off + region->width > cinfo->output_width ||
+	    region->y_off + region->height > cinfo->output_height)
 		longjmp(wp_err.env, 1);
 
+	/* column offset is aligned to iMCU boundary by libjpeg */
+	x_off = region->x_off;
+	width = region->width;
+	if (width != cinfo->output_width) {
+		jpeg_crop_scanline(cinfo, &x_off, &width);
+		debug("decoding JPEG columns %u to %u\n", x_off,
+		    x_off + width - 1);
+	}
+	height = region->height;
+	if (height != cinfo->output_height) {
+		if (jpeg_skip_scanlines(cinfo, region->y_off) != region->y_off)
+			longjmp(wp_err.env, 1);
+		debug("decoding JPEG rows %u to %u\n", region->y_off,
+		    region->y_off + height - 1);
+	}
+
+	SAFE_MUL3(len, width, height, sizeof(**pixels));
+	p = *pixels = xmalloc(len);
+
 	for (y = 0; y < height; y++) {
 		jpeg_read_scanlines(cinfo, (JSAMPARRAY)&p, 1);
 		p += width;
 	}
 
-	jpeg_finish_decompress(cinfo);
+	/* remaining rows are not needed */
+	if (cinfo->output_scanline == cinfo->output_height)
+		jpeg_finish_decompress(cinfo);
 	jpeg_destroy_decompress(cinfo);
 
-	img = pixman_image_create_bits(PIXMAN_a8r8g8b8, width, height, *pixels,
+	region->x_off = x_off;
+	region->width = width;
+
+	/* JPEG images are always opaque */
+	img = pixman_image_create_bits(PIXMAN_x8r8g8b8, width, height, *pixels,
 	    width * sizeof(uint32_t));
 	if (img == NULL)
 		errx(1, "failed to create pixman image");
+	pixman_image_set_destroy_function(img, free_pixels, *pixels);
 
 	return img;
 }
 
+int
+probe_jpeg(const uint8_t *data, size_t len, wp_info_t *info)
+{
+	struct jpeg_decompress_struct cinfo;
+
+	return do_probe_jpeg(data, len, &cinfo, info);
+}
+
 pixman_image_t *
-load_jpeg(FILE *fp)
+load_jpeg(const uint8_t *data, size_t len, unsigned int denom,
+    wp_box_t *region)
 {
 	struct jpeg_decompress_struct cinfo;
 	pixman_image_t *img;
 	uint32_t *pixels;
 
 	pixels = NULL;
-	img = do_load_jpeg(fp, &cinfo, &pixels);
+	img = do_load_jpeg(data, len, denom, region, &cinfo, &pixels);
 	if (img == NULL)
 		free(pixels);
 	return img;
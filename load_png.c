@@ -20,37 +20,195 @@
 #include <png.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "functions.h"
 
-#define HEADER_LEN	4
+typedef struct wp_src {
+	const uint8_t	*data;
+	size_t		 len;
+	size_t		 pos;
+} wp_src_t;
 
+/* memory of decoding, released by load_png even after errors */
+typedef struct wp_mem {
+	uint32_t	*pixels;
+	png_bytepp	 rows;
+	png_bytep	 row;
+	uint32_t	*sums;
+} wp_mem_t;
+
+static void
+read_png(png_structp png_ptr, png_bytep out, png_size_t len)
+{
+	wp_src_t *src;
+
+	src = png_get_io_ptr(png_ptr);
+	if (src->len - src->pos < len)
+		png_error(png_ptr, "unexpected end of file");
+	memcpy(out, src->data + src->pos, len);
+	src->pos += len;
+}
+
+static int
+do_probe_png(wp_src_t *src, png_structp *png_ptr, png_infop *info_ptr,
+    wp_info_t *info)
+{
+	png_byte type;
+
+	*png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+	    NULL, NULL, NULL);
+	if (*png_ptr == NULL)
+		errx(1, "failed to initialize png struct");
+
+	if (setjmp(png_jmpbuf(*png_ptr))) {
+		debug("failed to parse PNG header\n");
+		png_destroy_read_struct(png_ptr, info_ptr, NULL);
+		return 1;
+	}
+
+	*info_ptr = png_create_info_struct(*png_ptr);
+	if (*info_ptr == NULL) {
+		debug("failed to initialize png info");
+		png_destroy_read_struct(png_ptr, NULL, NULL);
+		return 1;
+	}
+
+	png_set_read_fn(*png_ptr, src, read_png);
+	png_read_info(*png_ptr, *info_ptr);
+
+	type = png_get_color_type(*png_ptr, *info_ptr);
+	*info = (wp_info_t){
+		.format = FORMAT_PNG,
+		.width = png_get_image_width(*png_ptr, *info_ptr),
+		.height = png_get_image_height(*png_ptr, *info_ptr),
+		.depth = png_get_bit_depth(*png_ptr, *info_ptr),
+		.alpha = (type & PNG_COLOR_MASK_ALPHA) ||
+		    (type == PNG_COLOR_TYPE_PALETTE &&
+		    png_get_valid(*png_ptr, *info_ptr, PNG_INFO_tRNS)),
+		.interlaced = png_get_interlace_type(*png_ptr, *info_ptr) !=
+		    PNG_INTERLACE_NONE
+	};
+
+	png_destroy_read_struct(png_ptr, info_ptr, NULL);
+
+	return 0;
+}
+
+/*
+ * Multiplies colors with alpha, because pixman expects premultiplied
+ * pixels.  Red and blue are multiplied at once in 16 bit lanes of a 32
+ * bit word.  Returns 1 if all pixels are opaque.
+ */
 static int
-is_png(FILE *fp)
+premultiply(uint32_t *pixels, size_t n)
 {
-	int valid;
-	uint8_t header[HEADER_LEN];
+	uint32_t a, g, rb;
+	size_t i;
+	int opaque;
+
+	opaque = 1;
+	for (i = 0; i < n; i++) {
+		a = pixels[i] >> 24;
+		if (a == 0xff)
+			continue;
+		opaque = 0;
+		rb = (pixels[i] & 0x00ff00ff) * a + 0x00800080;
+		rb = ((rb + ((rb >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+		g = (pixels[i] & 0x0000ff00) * a + 0x00008000;
+		g = ((g + ((g >> 8) & 0x0000ff00)) >> 8) & 0x0000ff00;
+		pixels[i] = (a << 24) | rb | g;
+	}
+
+	return opaque;
+}
+
+/*
+ * Averages blocks of denom x denom pixels while rows are streamed from
+ * the decoder, so only one row and its sums are kept besides the
+ * reduced region.  Blocks at the right and bottom edge may be smaller.
+ * Rows with alpha are premultiplied before they are averaged.  Returns
+ * 1 if all averaged pixels are opaque.
+ */
+static int
+reduce_rows(png_structp png_ptr, png_uint_32 width, png_uint_32 height,
+    unsigned int denom, wp_box_t *region, int alpha, wp_mem_t *mem)
+{
+	png_bytep row, s;
+	uint32_t *sums, *sum;
+	uint8_t *p;
+	png_uint_32 first, last, left, right, x, x1, x2, y;
+	unsigned int c, n, rows;
+	size_t len;
+	int opaque;
+
+	SAFE_MUL3(len, region->width, 4, sizeof(*sums));
+	sums = mem->sums = xmalloc(len);
+	memset(sums, 0, len);
+	SAFE_MUL(len, width, sizeof(*mem->pixels));
+	row = mem->row = xmalloc(len);
+
+	first = region->y_off * denom;
+	last = (region->y_off + region->height) * denom;
+	if (last > height)
+		last = height;
+	left = region->x_off * denom;
+	right = (region->x_off + region->width) * denom;
+	if (right > width)
+		right = width;
 
-	valid = fread(header, 1, HEADER_LEN, fp) == HEADER_LEN &&
-	    png_sig_cmp(header, 0, HEADER_LEN) == 0;
-	rewind(fp);
+	p = (uint8_t *)mem->pixels;
+	opaque = 1;
+	rows = 0;
+	for (y = 0; y < last; y++) {
+		png_read_row(png_ptr, row, NULL);
+		if (y < first)
+			continue;
+		if (alpha)
+			opaque &= premultiply((uint32_t *)row + left,
+			    right - left);
 
-	return valid;
+		sum = sums;
+		for (x = 0; x < region->width; x++, sum += 4) {
+			x1 = (region->x_off + x) * denom;
+			x2 = x1 + denom > width ? width : x1 + denom;
+			for (s = row + x1 * 4; s < row + x2 * 4; s += 4)
+				for (c = 0; c < 4; c++)
+					sum[c] += s[c];
+		}
+		if (++rows < denom && y + 1 < last)
+			continue;
+
+		/* byte order of pixels stays as decoded */
+		sum = sums;
+		for (x = 0; x < region->width; x++, sum += 4) {
+			x1 = (region->x_off + x) * denom;
+			x2 = x1 + denom > width ? width : x1 + denom;
+			n = (x2 - x1) * rows;
+			for (c = 0; c < 4; c++) {
+				*p++ = (sum[c] + n / 2) / n;
+				sum[c] = 0;
+			}
+		}
+		rows = 0;
+	}
+
+	debug("decoded PNG rows %u to %u, averaged %ux%u blocks\n", first,
+	    last - 1, denom, denom);
+
+	return opaque;
 }
 
 static pixman_image_t *
-do_load_png(FILE *fp, png_structp *png_ptr, png_infop *info_ptr,
-    uint32_t **pixels)
+do_load_png(wp_src_t *src, unsigned int denom, wp_box_t *region,
+    png_structp *png_ptr, png_infop *info_ptr, wp_mem_t *mem)
 {
 	pixman_image_t *img;
-	png_bytepp rows;
 	uint32_t *p;
 	png_byte type, depth;
 	png_uint_32 y, width, height;
 	size_t len;
-
-	if (!is_png(fp))
-		return NULL;
+	int alpha, opaque, passes;
 
 	*png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
 	    NULL, NULL, NULL);
@@ -70,15 +228,20 @@ do_load_png(FILE *fp, png_structp *png_ptr, png_infop *info_ptr,
 		return NULL;
 	}
 
-	png_init_io(*png_ptr, fp);
+	png_set_read_fn(*png_ptr, src, read_png);
 
 	png_read_info(*png_ptr, *info_ptr);
 	width = png_get_image_width(*png_ptr, *info_ptr);
 	height = png_get_image_height(*png_ptr, *info_ptr);
 	type = png_get_color_type(*png_ptr, *info_ptr);
 	depth = png_get_bit_depth(*png_ptr, *info_ptr);
+	alpha = (type & PNG_COLOR_MASK_ALPHA) ||
+	    (type == PNG_COLOR_TYPE_PALETTE &&
+	    png_get_valid(*png_ptr, *info_ptr, PNG_INFO_tRNS));
 #if defined(PNG_READ_INTERLACING_SUPPORTED)
-	png_set_interlace_handling(*png_ptr);
+	passes = png_set_interlace_handling(*png_ptr);
+#else
+	passes = 1;
 #endif /* PNG_READ_INTERLACING_SUPPORTED */
 
 	switch (type) {
@@ -106,39 +269,103 @@ do_load_png(FILE *fp, png_structp *png_ptr, png_infop *info_ptr,
 		png_set_bgr(*png_ptr);
 	png_read_update_info(*png_ptr, *info_ptr);
 
-	SAFE_MUL3(len, width, height, sizeof(**pixels));
-	p = *pixels = xmalloc(len);
+	/* interlaced images are never reduced, see get_scale_denom */
+	if (passes > 1 && denom != 1)
+		png_error(*png_ptr, "interlaced image cannot be reduced");
+	if (region->x_off + region->width > (width + denom - 1) / denom ||
+	    region->y_off + region->height > (height + denom - 1) / denom)
+		png_error(*png_ptr, "region exceeds image");
+
+	/* interlaced images have to be read completely */
+	if (passes > 1 || (denom == 1 && region->width == width &&
+	    region->height == height)) {
+		SAFE_MUL3(len, width, height, sizeof(*mem->pixels));
+		p = mem->pixels = xmalloc(len);
+
+		SAFE_MUL(len, height, sizeof(*mem->rows));
+		mem->rows = xmalloc(len);
+		for (y = 0; y < height; y++) {
+			mem->rows[y] = (png_bytep)p;
+			p += width;
+		}
+		png_read_image(*png_ptr, mem->rows);
+		opaque = !alpha ||
+		    premultiply(mem->pixels, (size_t)width * height);
 
-	SAFE_MUL(len, height, sizeof(*rows));
-	rows = xmalloc(len);
-	for (y = 0; y < height; y++) {
-		rows[y] = (png_bytep)p;
-		p += width;
+		*region = (wp_box_t){
+			.x_off = 0,
+			.y_off = 0,
+			.width = width,
+			.height = height
+		};
+	} else if (denom != 1) {
+		SAFE_MUL3(len, region->width, region->height,
+		    sizeof(*mem->pixels));
+		mem->pixels = xmalloc(len);
+		opaque = reduce_rows(*png_ptr, width, height, denom, region,
+		    alpha, mem);
+	} else {
+		SAFE_MUL3(len, region->width, region->height,
+		    sizeof(*mem->pixels));
+		p = mem->pixels = xmalloc(len);
+
+		/* read rows up to the last visible one */
+		SAFE_MUL(len, width, sizeof(*mem->pixels));
+		mem->row = xmalloc(len);
+		opaque = 1;
+		for (y = 0; y < region->y_off + region->height; y++) {
+			png_read_row(*png_ptr, mem->row, NULL);
+			if (y < region->y_off)
+				continue;
+			memcpy(p, mem->row + region->x_off * sizeof(*p),
+			    region->width * sizeof(*p));
+			if (alpha)
+				opaque &= premultiply(p, region->width);
+			p += region->width;
+		}
+		debug("decoded PNG rows %u to %u\n", region->y_off,
+		    region->y_off + region->height - 1);
 	}
-	png_read_image(*png_ptr, rows);
-	free(rows);
 
 	png_destroy_read_struct(png_ptr, info_ptr, NULL);
 
-	img = pixman_image_create_bits(PIXMAN_a8r8g8b8, width, height, *pixels,
-	    width * sizeof(uint32_t));
+	/* fully opaque images are copied without alpha */
+	img = pixman_image_create_bits(opaque ? PIXMAN_x8r8g8b8 :
+	    PIXMAN_a8r8g8b8, region->width, region->height, mem->pixels,
+	    region->width * sizeof(uint32_t));
 	if (img == NULL)
 		errx(1, "failed to create pixman image");
+	pixman_image_set_destroy_function(img, free_pixels, mem->pixels);
 
 	return img;
 }
 
+int
+probe_png(const uint8_t *data, size_t len, wp_info_t *info)
+{
+	png_structp png_ptr;
+	png_infop info_ptr;
+	wp_src_t src = { data, len, 0 };
+
+	info_ptr = NULL;
+	return do_probe_png(&src, &png_ptr, &info_ptr, info);
+}
+
 pixman_image_t *
-load_png(FILE *fp)
+load_png(const uint8_t *data, size_t len, unsigned int denom,
+    wp_box_t *region)
 {
 	png_structp png_ptr;
 	png_infop info_ptr;
 	pixman_image_t *img;
-	uint32_t *pixels;
+	wp_mem_t mem = { NULL, NULL, NULL, NULL };
+	wp_src_t src = { data, len, 0 };
 
-	pixels = NULL;
-	img = do_load_png(fp, &png_ptr, &info_ptr, &pixels);
+	img = do_load_png(&src, denom, region, &png_ptr, &info_ptr, &mem);
 	if (img == NULL)
-		free(pixels);
+		free(mem.pixels);
+	free(mem.rows);
+	free(mem.row);
+	free(mem.sums);
 	return img;
 }
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2025 Tobias Stoeckmann <tobias@stoeckmann.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <err.h>
+#include <pixman.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "functions.h"
+
+static int
+read_header(const uint8_t *data, size_t len, wp_raw_t *header)
+{
+	pixman_format_code_t format;
+
+	if (len < sizeof(*header)) {
+		debug("failed to read raw header\n");
+		return 1;
+	}
+	memcpy(header, data, sizeof(*header));
+	if (memcmp(header->magic, RAW_MAGIC, sizeof(header->magic)) != 0) {
+		debug("failed to read raw header\n");
+		return 1;
+	}
+
+	/* only formats which are written, all with whole bytes per pixel */
+	format = header->format;
+	switch (format) {
+	case PIXMAN_a8r8g8b8:
+	case PIXMAN_x8r8g8b8:
+	case PIXMAN_r5g6b5:
+	case PIXMAN_x2r10g10b10:
+		break;
+	default:
+		debug("unsupported raw format\n");
+		return 1;
+	}
+	if (header->width == 0 || header->width > UINT16_MAX ||
+	    header->height == 0 || header->height > UINT16_MAX ||
+	    header->stride > INT32_MAX ||
+	    header->stride % sizeof(uint32_t) != 0 ||
+	    (uint64_t)header->stride * 8 <
+	    (uint64_t)header->width * PIXMAN_FORMAT_BPP(format) ||
+	    header->offset < sizeof(*header) ||
+	    header->offset % RAW_ALIGN != 0) {
+		debug("invalid raw header\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+int
+probe_raw(const uint8_t *data, size_t len, wp_info_t *info)
+{
+	wp_raw_t header;
+
+	if (read_header(data, len, &header))
+		return 1;
+
+	*info = (wp_info_t){
+		.format = FORMAT_RAW,
+		.width = header.width,
+		.height = header.height,
+		.depth = PIXMAN_FORMAT_DEPTH(header.format),
+		.alpha = PIXMAN_FORMAT_A(header.format) != 0,
+		.interlaced = 0
+	};
+
+	return 0;
+}
+
+/*
+ * Pixels are used directly from the mapped file, therefore the buffer
+ * must stay mapped as long as the image exists.
+ */
+pixman_image_t *
+load_raw(const uint8_t *data, size_t len)
+{
+	pixman_image_t *img;
+	wp_raw_t header;
+	size_t size;
+
+	if (read_header(data, len, &header))
+		return NULL;
+
+	SAFE_MUL(size, (size_t)header.stride, header.height);
+	if (len < header.offset || len - header.offset < size) {
+		debug("raw image is truncated\n");
+		return NULL;
+	}
+
+	/* pixman never writes to source images */
+	img = pixman_image_create_bits(header.format, header.width,
+	    header.height, (uint32_t *)(data + header.offset),
+	    header.stride);
+	if (img == NULL)
+		errx(1, "failed to create pixman image");
+
+	return img;
+}
+
+int
+write_raw(FILE *fp, pixman_image_t *img)
+{
+	static const uint8_t zero[RAW_ALIGN];
+	wp_raw_t header;
+	uint8_t *row;
+	int y;
+
+	header = (wp_raw_t){
+		.magic = RAW_MAGIC,
+		.format = pixman_image_get_format(img),
+		.width = pixman_image_get_width(img),
+		.height = pixman_image_get_height(img),
+		.stride = pixman_image_get_stride(img),
+		.offset = RAW_ALIGN
+	};
+
+	if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+	    fwrite(zero, RAW_ALIGN - sizeof(header), 1, fp) != 1)
+		return 1;
+
+	row = (uint8_t *)pixman_image_get_data(img);
+	for (y = 0; y < pixman_image_get_height(img); y++) {
+		if (fwrite(row, header.stride, 1, fp) != 1)
+			return 1;
+		row += header.stride;
+	}
+
+	return 0;
+}
@@ -14,9 +14,6 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include <sys/types.h>
-#include <sys/stat.h>
-
 #include <X11/xpm.h>
 
 #include <xcb/xcb.h>
@@ -25,12 +22,87 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
 
 #include "functions.h"
 
+#define XPM2_MAGIC	"! XPM2"
+
+/*
+ * Lets libXpm parse the whole file, which also understands XPM1 files
+ * and layouts which are not recognized by probe_xpm.
+ */
+static int
+parse_xpm(const uint8_t *data, size_t len, unsigned int *width,
+    unsigned int *height)
+{
+	XpmImage xpm_image;
+
+	if (strlen((const char *)data) != len ||
+	    XpmCreateXpmImageFromBuffer((char *)data, &xpm_image, NULL)) {
+		debug("failed to parse XPM file\n");
+		return 1;
+	}
+	*width = xpm_image.width;
+	*height = xpm_image.height;
+	XpmFreeXpmImage(&xpm_image);
+
+	return 0;
+}
+
+/*
+ * Parses the values section of XPM and XPM2 files, which is the first
+ * string respectively line after the header. Colors and pixels are not
+ * looked at.  Other files are parsed completely by libXpm.
+ */
+int
+probe_xpm(const uint8_t *data, size_t len, wp_info_t *info)
+{
+	unsigned int width, height, ncolors, cpp;
+	const char *p;
+	int prev;
+
+	/* contents are terminated, so string functions are safe */
+	p = (const char *)data;
+	if (len >= sizeof(XPM2_MAGIC) - 1 &&
+	    memcmp(p, XPM2_MAGIC, sizeof(XPM2_MAGIC) - 1) == 0) {
+		p = strchr(p, '\n');
+	} else {
+		prev = 0;
+		for (; *p != '\0' && *p != '"'; p++) {
+			if (prev == '/' && *p == '*') {
+				if ((p = strstr(p + 1, "*/")) == NULL)
+					break;
+				p++;
+				prev = 0;
+				continue;
+			}
+			prev = *p;
+		}
+		if (p != NULL && *p == '\0')
+			p = NULL;
+	}
+	if (p == NULL || sscanf(p + 1, "%u %u %u %u", &width, &height,
+	    &ncolors, &cpp) != 4) {
+		debug("failed to find XPM values, trying libXpm\n");
+		if (parse_xpm(data, len, &width, &height))
+			return 1;
+	}
+
+	*info = (wp_info_t){
+		.format = FORMAT_XPM,
+		.width = width,
+		.height = height,
+		.depth = 8,
+		.alpha = 0,
+		.interlaced = 0
+	};
+
+	return 0;
+}
+
 pixman_image_t *
-load_xpm(xcb_connection_t *c, xcb_screen_t *screen, FILE *fp)
+load_xpm(xcb_connection_t *c, xcb_screen_t *screen, const uint8_t *data,
+    size_t size)
 {
 	pixman_image_t *img;
 	XpmImage xpm_image;
@@ -38,26 +110,16 @@ load_xpm(xcb_connection_t *c, xcb_screen_t *screen, FILE *fp)
 	XpmColor *color;
 	uint8_t *colormap;
 	uint32_t *pixel, *pixels;
-	struct stat st;
-	int fd;
-	char *buf;
 	size_t j, clen, len;
 	unsigned int *d, i, width, height;
 
-	if ((fd = fileno(fp)) == -1 || fstat(fd, &st) ||
-	    st.st_size < 0 || (uintmax_t)st.st_size > (uintmax_t)SIZE_MAX) {
-		debug("failed to handle size of XPM file\n");
-		return NULL;
-	}
-
-	buf = xmalloc((size_t)st.st_size);
-	if (fread(buf, (size_t)st.st_size, 1, fp) != 1 ||
-	    XpmCreateXpmImageFromBuffer(buf, &xpm_image, &xpm_info)) {
+	/* terminated contents are parsed in place and never modified */
+	if (strlen((const char *)data) != size ||
+	    XpmCreateXpmImageFromBuffer((char *)data, &xpm_image,
+	    &xpm_info)) {
 		debug("failed to parse XPM file\n");
-		free(buf);
 		return NULL;
 	}
-	free(buf);
 	XpmFreeXpmInfo(&xpm_info);
 
 	SAFE_MUL(clen, 3, xpm_image.ncolors);
@@ -121,10 +183,12 @@ load_xpm(xcb_connection_t *c, xcb_screen_t *screen, FILE *fp)
 	free(colormap);
 	XpmFreeXpmImage(&xpm_image);
 
-	img = pixman_image_create_bits(PIXMAN_a8r8g8b8, width, height, pixels,
+	/* transparent pixels are black, so the image is opaque */
+	img = pixman_image_create_bits(PIXMAN_x8r8g8b8, width, height, pixels,
 	    width * sizeof(uint32_t));
 	if (img == NULL)
 		errx(1, "failed to create pixman image");
+	pixman_image_set_destroy_function(img, free_pixels, pixels);
 
 	return img;
 }
@@ -20,13 +20,16 @@
   #include <xcb/randr.h>
 #endif /* WITH_RANDR */
 #include <xcb/xcb.h>
-#include <xcb/xcb_image.h>
 
 #include <err.h>
+#include <fcntl.h>
+#include <float.h>
 #include <pixman.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "functions.h"
@@ -34,24 +37,33 @@
 #define ATOM_ESETROOT "ESETROOT_PMAP_ID"
 #define ATOM_XSETROOT "_XROOTPMAP_ID"
 
-#define MAXIMUM(x, y) ((x) > (y) ? (x) : (y))
+#ifdef WITH_SHM
+/* MIT-SHM segments are received as file descriptors */
+#define PROMISES "stdio recvfd"
+#else
+#define PROMISES "stdio"
+#endif /* WITH_SHM */
+
+/* smallest band worth handing to another thread */
+#define MIN_BAND_HEIGHT	32
 
 #ifdef WITH_RANDR
 xcb_pixmap_t created_pixmap = XCB_BACK_PIXMAP_NONE;
+
+/* screens changed since they were drawn, only set in daemon mode */
+static int *changed;
 #endif /* WITH_RANDR */
 
 static uint32_t
-get_max_rows_per_request(xcb_connection_t *c, xcb_image_t *image, uint32_t n)
+get_max_rows_per_request(xcb_connection_t *c, uint32_t row_len, uint32_t n)
 {
-	uint32_t max_len, max_req_len, row_len, max_height;
+	uint32_t max_len, max_req_len, max_height;
 
 	max_req_len = xcb_get_maximum_request_length(c);
 	max_len = (max_req_len > n ? n : max_req_len) * 4;
 	if (max_len <= sizeof(xcb_put_image_request_t))
 		errx(1, "unable to put image on X server");
 	max_len -= sizeof(xcb_put_image_request_t);
-	row_len = (image->stride + image->scanline_pad - 1) &
-	    -image->scanline_pad;
 	max_height = max_len / row_len;
 	if (max_height < 1)
 		errx(1, "unable to put image on X server");
@@ -64,83 +76,323 @@ get_max_rows_per_request(xcb_connection_t *c, xcb_image_t *image, uint32_t n)
 	return max_height;
 }
 
+static int
+probe_image(const uint8_t *data, size_t len, wp_info_t *info)
+{
+	int ret;
+
+	if (len >= 8 && memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0) {
+#ifdef WITH_PNG
+		ret = probe_png(data, len, info);
+#else
+		debug("PNG support is disabled\n");
+		ret = 1;
+#endif /* WITH_PNG */
+	} else if (len >= 8 && memcmp(data, RAW_MAGIC, 8) == 0) {
+		ret = probe_raw(data, len, info);
+	} else if (len >= 3 && memcmp(data, "\xff\xd8\xff", 3) == 0) {
+#ifdef WITH_JPEG
+		ret = probe_jpeg(data, len, info);
+#else
+		debug("JPEG support is disabled\n");
+		ret = 1;
+#endif /* WITH_JPEG */
+	} else {
+		/* XPM has no magic bytes, therefore it is the fallback */
+#ifdef WITH_XPM
+		ret = probe_xpm(data, len, info);
+#else
+		debug("unknown file format\n");
+		ret = 1;
+#endif /* WITH_XPM */
+	}
+
+	return ret;
+}
+
 static pixman_image_t *
-load_pixman_image(xcb_connection_t *c, xcb_screen_t *screen, FILE *fp)
+load_pixman_image(xcb_connection_t *c, xcb_screen_t *screen,
+    wp_buffer_t *buffer, wp_box_t *region)
 {
 	pixman_image_t *pixman_image;
 
 	pixman_image = NULL;
 
-#ifdef WITH_PNG
-	if (pixman_image == NULL) {
-		rewind(fp);
-		pixman_image = load_png(fp);
-	}
-#endif /* WITH_PNG */
+	switch (buffer->info.format) {
 #ifdef WITH_JPEG
-	if (pixman_image == NULL) {
-		rewind(fp);
-		pixman_image = load_jpeg(fp);
-	}
+	case FORMAT_JPEG:
+		pixman_image = load_jpeg(buffer->data, buffer->len,
+		    buffer->denom, region);
+		break;
 #endif /* WITH_JPEG */
+#ifdef WITH_PNG
+	case FORMAT_PNG:
+		pixman_image = load_png(buffer->data, buffer->len,
+		    buffer->denom, region);
+		break;
+#endif /* WITH_PNG */
 #ifdef WITH_XPM
-	if (pixman_image == NULL) {
-		rewind(fp);
-		pixman_image = load_xpm(c, screen, fp);
-	}
+	case FORMAT_XPM:
+		pixman_image = load_xpm(c, screen, buffer->data,
+		    buffer->len);
+		break;
 #endif /* WITH_XPM */
+	case FORMAT_RAW:
+		pixman_image = load_raw(buffer->data, buffer->len);
+		break;
+	default:
+		break;
+	}
 
 	return pixman_image;
 }
 
+typedef struct wp_load {
+	wp_option_t	*option;
+	wp_box_t	 region;
+	pixman_image_t	*pixman_image;
+	/* decoded with denom, halved until target is reached */
+	unsigned int	 denom;
+	unsigned int	 target;
+} wp_load_t;
+
+static void
+load_task(void *arg, size_t i)
+{
+	wp_load_t *load;
+	wp_buffer_t *buffer;
+	pixman_image_t *half;
+
+	load = (wp_load_t *)arg + i;
+	buffer = load->option->buffer;
+	if (buffer->info.format != FORMAT_XPM)
+		load->pixman_image = load_pixman_image(NULL, NULL, buffer,
+		    &load->region);
+	if (load->pixman_image == NULL ||
+	    pixman_image_get_width(load->pixman_image) !=
+	    (int)load->region.width ||
+	    pixman_image_get_height(load->pixman_image) !=
+	    (int)load->region.height)
+		return;
+
+	/* pyramid of halved images, only the last one is kept */
+	while (load->denom < load->target &&
+	    (half = halve_image(load->pixman_image, &load->region)) != NULL) {
+		pixman_image_unref(load->pixman_image);
+		load->pixman_image = half;
+		load->denom *= 2;
+	}
+}
+
 static void
 load_pixman_images(xcb_connection_t *c, xcb_screen_t *screen,
-    wp_option_t *options)
+    wp_config_t *config)
 {
 	wp_option_t *opt;
+	wp_buffer_t *buffer;
+	wp_box_t region, *old;
+	wp_load_t *loads;
 	pixman_image_t *img;
-
-	for (opt = options; opt != NULL && opt->filename != NULL; opt++)
-		if (opt->buffer->pixman_image == NULL) {
-			int height, width;
-
-			debug("loading %s\n", opt->filename);
-			img = load_pixman_image(c, screen, opt->buffer->fp);
-			if (img == NULL)
+	unsigned int denom, target;
+	size_t i, len, n;
+
+	/* reject unusable files before decoding any of them */
+	for (opt = config->options; opt != NULL && opt->filename != NULL;
+	    opt++) {
+		wp_info_t *info = &opt->buffer->info;
+
+		if (info->format == 0) {
+			debug("probing %s\n", opt->filename);
+			if (probe_image(opt->buffer->data, opt->buffer->len,
+			    info))
 				errx(1, "failed to parse %s", opt->filename);
-			opt->buffer->pixman_image = img;
-			fclose(opt->buffer->fp);
+			debug("%s: %ux%u, %d bit%s%s\n", opt->filename,
+			    info->width, info->height, info->depth,
+			    info->alpha ? ", alpha" : "",
+			    info->interlaced ? ", interlaced" : "");
+		}
 
-			height = pixman_image_get_height(img);
-			width = pixman_image_get_width(img);
+		if (info->width == 0 || info->height == 0 ||
+		    info->height > UINT16_MAX || info->width > UINT16_MAX)
+			errx(1, "%s has illegal dimensions", opt->filename);
 
-			if (height > UINT16_MAX || width > UINT16_MAX)
-				errx(1, "%s has illegal dimensions",
-				    opt->filename);
+		if (opt->trim != NULL) {
+			wp_box_t *trim = opt->trim;
 
-			if (opt->trim != NULL) {
-				wp_box_t *trim = opt->trim;
+			if (info->height < trim->y_off + trim->height ||
+			    info->width < trim->x_off + trim->width)
+				errx(1, "%s is smaller than trim box",
+				    opt->filename);
+		}
+	}
 
-				if (height < trim->y_off + trim->height ||
-				    width < trim->x_off + trim->width)
-					errx(1, "%s is smaller than trim box",
-					    opt->filename);
-			}
+	if (config->count == 0)
+		return;
+	SAFE_MUL(len, config->count, sizeof(*loads));
+	loads = xmalloc(len);
+	n = 0;
+
+	for (opt = config->options; opt != NULL && opt->filename != NULL;
+	    opt++) {
+		buffer = opt->buffer;
+		/* unused images are not decoded at all */
+		if (buffer->count == 0)
+			continue;
+		/* options can share buffers */
+		for (i = 0; i < n; i++)
+			if (loads[i].option->buffer == buffer)
+				break;
+		if (i != n)
+			continue;
+		denom = get_scale_denom(buffer);
+		target = get_reduce_denom(buffer);
+
+		if (buffer->pixman_image != NULL) {
+			/* outputs might have grown in daemon mode */
+			old = &buffer->region;
+			get_region(buffer, buffer->denom, &region);
+			if (target >= buffer->denom &&
+			    region.x_off >= old->x_off &&
+			    region.y_off >= old->y_off &&
+			    region.x_off + region.width <=
+			    old->x_off + old->width &&
+			    region.y_off + region.height <=
+			    old->y_off + old->height)
+				continue;
+			debug("reloading %s for larger output\n",
+			    opt->filename);
+			/* pixels are released by destroy function */
+			pixman_image_unref(buffer->pixman_image);
+			buffer->pixman_image = NULL;
 		}
+
+		get_region(buffer, denom, &region);
+		if ((uint64_t)region.width * region.height > PIXEL_BUDGET)
+			errx(1, "%s exceeds pixel budget", opt->filename);
+
+		debug("loading %s\n", opt->filename);
+		buffer->denom = denom;
+		loads[n++] = (wp_load_t){
+			.option = opt,
+			.region = region,
+			.pixman_image = NULL,
+			.denom = denom,
+			.target = target
+		};
+	}
+
+	/* XPM needs the X connection, which is not shared with threads */
+	for (i = 0; i < n; i++)
+		if (loads[i].option->buffer->info.format == FORMAT_XPM)
+			loads[i].pixman_image = load_pixman_image(c, screen,
+			    loads[i].option->buffer, &loads[i].region);
+	run_tasks(load_task, loads, n);
+
+	for (i = 0; i < n; i++) {
+		opt = loads[i].option;
+		buffer = opt->buffer;
+		img = loads[i].pixman_image;
+		/* decoders may widen the region to their block size */
+		if (img == NULL ||
+		    pixman_image_get_width(img) != (int)loads[i].region.width ||
+		    pixman_image_get_height(img) != (int)loads[i].region.height)
+			errx(1, "failed to parse %s", opt->filename);
+		if (loads[i].denom != buffer->denom)
+			debug("reduced %s to 1/%u\n", opt->filename,
+			    loads[i].denom);
+		buffer->pixman_image = img;
+		buffer->region = loads[i].region;
+		buffer->denom = loads[i].denom;
+		/* raw images use the mapping, others may be reloaded */
+		if (!config->daemon && buffer->info.format != FORMAT_RAW)
+			unmap_buffer(buffer);
+	}
+	free(loads);
+}
+
+typedef struct wp_render {
+	wp_output_t		*output;
+	/* part of output showing the image, borders are filled by X */
+	wp_output_t		 area;
+	wp_option_t		*option;
+	pixman_format_code_t	 format;
+	size_t			 stride;
+	/* complete output, if shared with X server */
+	uint8_t			*pixels;
+	wp_cache_t		*cache;
+	size_t			 len;
+#ifdef WITH_SHM
+	uint32_t		 shmseg;
+#endif /* WITH_SHM */
+	pixman_transform_t	 transform;
+	pixman_filter_t		 filter;
+	pixman_fixed_t		*params;
+	int			 n_params;
+	/* integer scaling without pixman, see get_factor */
+	int			 factor;
+	int			 off_x;
+	int			 off_y;
+	int			 band_height;
+	/* destination and source image per slot, created on first use */
+	pixman_image_t		**images;
+	/* tasks of this output start and end before these indices */
+	size_t			 first;
+	size_t			 last;
+	/* identical output which is copied on server side */
+	struct wp_render	*twin;
+	/* tile filled on server side and its area in the image */
+	xcb_pixmap_t		 tile;
+	wp_box_t		 tile_box;
+#ifdef WITH_RENDER
+	/* source which is scaled on server side */
+	uint32_t		 picture;
+#endif /* WITH_RENDER */
+	/* tile or picture has been uploaded for this output */
+	int			 owner;
+} wp_render_t;
+
+typedef struct wp_band {
+	wp_render_t	*render;
+	uint8_t		*data;
+	size_t		 slot;
+	int		 y;
+	int		 height;
+} wp_band_t;
+
+/*
+ * Images are validated while compositing, so every thread needs its
+ * own source image.  Pixels are shared and only read.
+ */
+static pixman_image_t *
+create_source(wp_buffer_t *buffer)
+{
+	pixman_image_t *src;
+
+	src = pixman_image_create_bits(
+	    pixman_image_get_format(buffer->pixman_image),
+	    pixman_image_get_width(buffer->pixman_image),
+	    pixman_image_get_height(buffer->pixman_image),
+	    pixman_image_get_data(buffer->pixman_image),
+	    pixman_image_get_stride(buffer->pixman_image));
+	if (src == NULL)
+		errx(1, "failed to create temporary pixman image");
+
+	return src;
 }
 
 static void
-tile(pixman_image_t *dest, wp_output_t *output, wp_option_t *option)
+tile(pixman_image_t *dest, int dest_y, pixman_image_t *pixman_image,
+    wp_output_t *output, wp_option_t *option, int y, int height)
 {
-	pixman_image_t *pixman_image;
+	wp_buffer_t *buffer;
 	int src_width, src_height, src_x, src_y;
-	uint16_t off_x, off_y;
+	int off_x, off_y, top, bottom;
 
-	pixman_image = option->buffer->pixman_image;
+	buffer = option->buffer;
 
 	if (option->trim == NULL) {
-		src_width = pixman_image_get_width(pixman_image);
-		src_height = pixman_image_get_height(pixman_image);
+		src_width = buffer->info.width;
+		src_height = buffer->info.height;
 		src_x = 0;
 		src_y = 0;
 	} else {
@@ -150,25 +402,25 @@ tile(pixman_image_t *dest, wp_output_t *output, wp_option_t *option)
 		src_y = option->trim->y_off;
 	}
 
-	/* reset transformation and filter of transform calls */
-	pixman_image_set_transform(pixman_image, NULL);
-	pixman_image_set_filter(pixman_image, PIXMAN_FILTER_FAST, NULL, 0);
+	/* tiled images are never scaled, only cropped while decoding */
+	src_x -= buffer->region.x_off;
+	src_y -= buffer->region.y_off;
 
 	/*
-	 * Manually performs tiling to support separate modes per
-	 * screen with RandR. If possible, xwallpaper will let
-	 * X do the tiling natively.
-         */
-	for (off_y = 0; off_y < output->height; off_y += src_height) {
-		uint16_t h;
-
-		if (off_y + src_height > output->height)
-			h = output->height - off_y;
-		else
-			h = src_height;
+	 * Fills the pixmap which X tiles natively across the screen.  It
+	 * has the size of the image, so trimmed tiles are repeated in it.
+	 * RandR outputs are tiled on server side instead.
+	 *
+	 * Only the rows y to y + height are drawn, starting at dest_y.
+	 */
+	for (off_y = y - y % src_height; off_y < y + height;
+	    off_y += src_height) {
+		top = off_y < y ? y : off_y;
+		bottom = off_y + src_height > y + height ? y + height :
+		    off_y + src_height;
 
 		for (off_x = 0; off_x < output->width; off_x += src_width) {
-			uint16_t w;
+			int w;
 
 			if (off_x + src_width > output->width)
 				w = output->width - off_x;
@@ -177,316 +429,1069 @@ tile(pixman_image_t *dest, wp_output_t *output, wp_option_t *option)
 
 			debug("tiling %s for %s (area %dx%d+%d+%d)\n",
 			    option->filename, output->name != NULL ?
-			    output->name : "screen", w, h, off_x, off_y);
-			pixman_image_composite(PIXMAN_OP_CONJOINT_SRC,
-			    pixman_image, NULL, dest, src_x, src_y, 0, 0,
-			    off_x, off_y, w, h);
+			    output->name : "screen", w, bottom - top, off_x,
+			    top);
+			pixman_image_composite(PIXMAN_OP_SRC, pixman_image,
+			    NULL, dest, src_x, src_y + top - off_y, 0, 0,
+			    off_x, dest_y + top - y, w, bottom - top);
 		}
 	}
 }
 
+/*
+ * Bands sharing a slot never run at the same time, so images of a slot
+ * are reused by all of its bands without locking.
+ */
 static void
-transform(pixman_image_t *dest, wp_output_t *output, wp_option_t *option,
-    pixman_filter_t filter)
+compose_band(void *arg, size_t i)
 {
-	pixman_image_t *pixman_image;
-	pixman_f_transform_t ftransform;
-	pixman_transform_t transform;
-	int mode;
-	uint16_t pix_width, pix_height;
-	uint16_t src_width, src_height;
-	uint16_t xcb_width, xcb_height;
-	float w_scale, h_scale, scale;
-	float translate_x, translate_y;
-	float off_x, off_y;
-
-	mode = option->mode;
-	pixman_image = option->buffer->pixman_image;
-	pix_width = pixman_image_get_width(pixman_image);
-	pix_height = pixman_image_get_height(pixman_image);
-	xcb_width = output->width;
-	xcb_height = output->height;
+	wp_band_t *band;
+	wp_render_t *render;
+	pixman_image_t **dest, **src;
+	int dest_y, x, y;
+
+	band = (wp_band_t *)arg + i;
+	render = band->render;
+
+	/* skipped after drawing was aborted */
+	if (band->height == 0)
+		return;
+
+	if (render->cache != NULL && render->cache->pixels != NULL) {
+		/* bands are otherwise sent straight from the cache */
+		if (render->pixels != NULL)
+			memcpy(band->data, render->cache->pixels +
+			    (size_t)band->y * render->stride,
+			    (size_t)band->height * render->stride);
+		return;
+	}
 
-	if (option->trim == NULL) {
-		src_width = pix_width;
-		src_height = pix_height;
-		off_x = 0;
-		off_y = 0;
-	} else {
-		src_width = option->trim->width;
-		src_height = option->trim->height;
-		off_x = (float)option->trim->x_off;
-		off_y = (float)option->trim->y_off;
-	}
-
-	if (mode == MODE_FOCUS) {
-		float target_x, target_y;
-		uint16_t target_width, target_height;
-		float ratio;
-
-		debug("focus on trim box %hux%hu%+.0f%+.0f of %hux%hu for "
-		    "output %hux%hu\n", src_width, src_height, off_x, off_y,
-		    pix_width, pix_height, xcb_width, xcb_height);
-
-		ratio = (float)xcb_width / xcb_height;
-		debug("output ratio is %f\n", ratio);
-
-		/*
-		 * Calculate minimum box to use.
-		 *
-		 * The minimum box depends solely on the input image dimensions
-		 * and will be used if the specified trim box fully fits in it.
-		 *
-		 * This guarantees that we never zoom in further than needed
-		 * even on very small trim boxes.
-		 */
-		if (pix_width > xcb_width && pix_height > xcb_height) {
-			/*
-			 * If the input image is larger than output, then use
-			 * output dimensions. No zooming in occurs and leads
-			 * to best quality.
-			 */
-			target_width = xcb_width;
-			target_height = xcb_height;
-		} else {
-			/*
-			 * At least one dimension of input image is smaller than
-			 * the corresponding output dimension. Zooming in is
-			 * required to prevent black borders.
-			 */
-			float rx, ry;
-
-			rx = (float)xcb_width / pix_width;
-			ry = (float)xcb_height / pix_height;
-			debug("minimum box check: rx = %f, ry = %f\n", rx, ry);
-
-			/* Zoom in and keep aspect ratio of output. */
-			if (rx < ry) {
-				target_width = MAXIMUM(1, pix_height * ratio);
-				target_height = pix_height;
-			} else {
-				target_width = pix_width;
-				target_height = MAXIMUM(1, pix_width / ratio);
-			}
-		}
-		debug("minimum box dimensions are %hux%hu\n", target_width,
-		    target_height);
-
-		/*
-		 * If trim box fits into minimum box, then use minimum box.
-		 * Otherwise it means that box must be zoomed out to cover the
-		 * whole trim box. Black borders can occur due to this.
-		 */
-		if (src_width > target_width || src_height > target_height) {
-			float rx, ry;
-
-			rx = (float)src_width / target_width;
-			ry = (float)src_height / target_height;
-			debug("target box check: rx = %f, ry = %f\n", rx, ry);
-
-			/* Zoom out and keep aspect ratio of output. */
-			if (rx < ry) {
-				target_width = MAXIMUM(1, src_height * ratio);
-				target_height = src_height;
-			} else {
-				target_width = src_width;
-				target_height = MAXIMUM(1, src_width / ratio);
-			}
-		}
-		debug("target box dimensions are %hux%hu\n", target_width,
-		    target_height);
-
-		/*
-		 * Find proper offsets.
-		 *
-		 * If the image file lacks enough pixels around current box,
-		 * then black borders on output are unfortunate but inevitable.
-		 * It is much more important to keep the constraint of having
-		 * all pixels within the trim box on output.
-		 */
-		target_x = MAXIMUM(0, off_x - (target_width - src_width) / 2);
-		target_y = MAXIMUM(0, off_y - (target_height - src_height) / 2);
-
-		if (target_width > pix_width - target_x) {
-			if (target_width > pix_width)
-				target_x = (pix_width - target_width) / 2;
-			else
-				target_x = pix_width - target_width;
+	dest = &render->images[band->slot * 2];
+	src = &render->images[band->slot * 2 + 1];
+
+	/* shared memory is one image, otherwise slot buffer is a band */
+	if (render->pixels != NULL)
+		dest_y = band->y;
+	else
+		dest_y = 0;
+
+	if (*dest == NULL) {
+		*dest = pixman_image_create_bits(render->format,
+		    render->area.width, render->pixels != NULL ?
+		    render->area.height : render->band_height,
+		    (uint32_t *)(band->data - (size_t)dest_y * render->stride),
+		    render->stride);
+		if (*dest == NULL)
+			errx(1, "failed to create temporary pixman image");
+	}
+
+	if (*src == NULL) {
+		*src = create_source(render->option->buffer);
+		if (render->option->mode == MODE_TILE)
+			pixman_image_set_filter(*src, PIXMAN_FILTER_FAST,
+			    NULL, 0);
+		else if (render->factor == 0) {
+			pixman_image_set_filter(*src, render->filter,
+			    render->params, render->n_params);
+			pixman_image_set_transform(*src, &render->transform);
 		}
-		if (target_height > pix_height - target_y) {
-			if (target_height > pix_height)
-				target_y = (pix_height - target_height) / 2;
-			else
-				target_y = pix_height - target_height;
+	}
+
+	if (render->option->mode == MODE_TILE) {
+		tile(*dest, dest_y, *src, render->output, render->option,
+		    band->y, band->height);
+		return;
+	}
+
+	/* position of first pixel within output */
+	x = render->area.x - render->output->x;
+	y = render->area.y - render->output->y + band->y;
+
+	/* plain copy or conversion of pixels */
+	if (render->factor == 1) {
+		pixman_image_composite(PIXMAN_OP_SRC, *src, NULL, *dest,
+		    render->off_x + x, render->off_y + y, 0, 0, 0, dest_y,
+		    render->area.width, band->height);
+		return;
+	}
+	if (render->factor > 1) {
+		scale_band(*dest, dest_y, *src, render->factor,
+		    render->off_x + x, render->off_y + y, render->area.width,
+		    band->height);
+		return;
+	}
+	if (render->factor < 0) {
+		scale_band(*dest, dest_y, *src, render->factor,
+		    render->off_x - render->factor * x,
+		    render->off_y - render->factor * y, render->area.width,
+		    band->height);
+		return;
+	}
+
+	/* source offset keeps sampling positions of unbanded composition */
+	pixman_image_composite(PIXMAN_OP_SRC, *src, NULL, *dest,
+	    x, y, 0, 0, 0, dest_y, render->area.width, band->height);
+}
+
+typedef struct wp_filter {
+	pixman_fixed_t	 scale_x;
+	pixman_fixed_t	 scale_y;
+	pixman_fixed_t	*params;
+	int		 n_params;
+} wp_filter_t;
+
+/* filter parameters per scale, kept until outputs are composed */
+static wp_filter_t *filters;
+static size_t nfilters;
+
+/*
+ * Returns parameters of a separable Lanczos filter for reductions by
+ * scale_x and scale_y, or NULL if they cannot be created.
+ */
+static pixman_fixed_t *
+get_filter(double scale_x, double scale_y, int *n_params)
+{
+	wp_filter_t *filter;
+	pixman_fixed_t x, y;
+	size_t i, len;
+
+	x = pixman_double_to_fixed(scale_x < 1 ? 1 : scale_x);
+	y = pixman_double_to_fixed(scale_y < 1 ? 1 : scale_y);
+	for (i = 0; i < nfilters; i++)
+		if (filters[i].scale_x == x && filters[i].scale_y == y) {
+			*n_params = filters[i].n_params;
+			return filters[i].params;
 		}
 
-		mode = MODE_MAXIMIZE;
-		off_x = target_x;
-		off_y = target_y;
-		src_width = target_width;
-		src_height = target_height;
+	SAFE_MUL(len, nfilters + 1, sizeof(*filters));
+	filters = realloc(filters, len);
+	if (filters == NULL)
+		err(1, "failed to allocate memory");
+	filter = &filters[nfilters];
+	filter->scale_x = x;
+	filter->scale_y = y;
+	filter->params = pixman_filter_create_separable_convolution(
+	    &filter->n_params, x, y, PIXMAN_KERNEL_IMPULSE,
+	    PIXMAN_KERNEL_IMPULSE, PIXMAN_KERNEL_LANCZOS3,
+	    PIXMAN_KERNEL_LANCZOS3, 4, 4);
+	if (filter->params == NULL)
+		return NULL;
+	nfilters++;
+
+	*n_params = filter->n_params;
+	return filter->params;
+}
+
+static void
+free_filters(void)
+{
+	size_t i;
+
+	for (i = 0; i < nfilters; i++)
+		free(filters[i].params);
+	free(filters);
+	filters = NULL;
+	nfilters = 0;
+}
 
-		debug("final source box is %hux%hu%+.0f%+.0f\n", src_width,
-		    src_height, off_x, off_y);
+/*
+ * Limits the composed area to pixels which show the image.  Pixels
+ * outside of the decoded region are black if the filter does not reach
+ * the region, so they are left to the X server.  Bilinear filters reach
+ * one source pixel, Lanczos filters three pixels per scale factor.
+ * Without interpolation, all pixels outside of the region are black.
+ */
+static void
+get_area(wp_render_t *render, pixman_f_transform_t *ftransform)
+{
+	pixman_f_transform_t inverse;
+	wp_buffer_t *buffer;
+	wp_output_t *output;
+	double m[2], margin, x, y, x1, x2, y1, y2;
+	int i, left, right, top, bottom;
+
+	output = render->output;
+	buffer = render->option->buffer;
+	if (!pixman_f_transform_invert(&inverse, ftransform))
+		return;
+
+	/* whole pixels need no margin, not even through rounding errors */
+	if (render->factor != 0)
+		margin = -1e-6;
+	else if (render->params != NULL) {
+		margin = LANCZOS_RADIUS * (ftransform->m[0][0] >
+		    ftransform->m[1][1] ? ftransform->m[0][0] :
+		    ftransform->m[1][1]);
+		if (margin > (int)margin)
+			margin = (int)margin + 1;
+	} else
+		margin = 1;
+	x1 = y1 = DBL_MAX;
+	x2 = y2 = -DBL_MAX;
+	for (i = 0; i < 4; i++) {
+		x = i & 1 ? buffer->region.width + margin : -margin;
+		y = i & 2 ? buffer->region.height + margin : -margin;
+		m[0] = inverse.m[0][0] * x + inverse.m[0][1] * y +
+		    inverse.m[0][2];
+		m[1] = inverse.m[1][0] * x + inverse.m[1][1] * y +
+		    inverse.m[1][2];
+		x1 = m[0] < x1 ? m[0] : x1;
+		x2 = m[0] > x2 ? m[0] : x2;
+		y1 = m[1] < y1 ? m[1] : y1;
+		y2 = m[1] > y2 ? m[1] : y2;
 	}
 
-	w_scale = (float)src_width / xcb_width;
-	h_scale = (float)src_height / xcb_height;
+	/* rounded outwards, truncation is enough within output */
+	left = x1 <= 0 ? 0 : x1 >= output->width ? output->width : (int)x1;
+	top = y1 <= 0 ? 0 : y1 >= output->height ? output->height : (int)y1;
+	right = x2 >= output->width ? output->width : x2 <= 0 ? 0 : (int)x2;
+	bottom = y2 >= output->height ? output->height : y2 <= 0 ? 0 :
+	    (int)y2;
+	if (right < x2)
+		right++;
+	if (bottom < y2)
+		bottom++;
+	/* image is not visible at all */
+	if (left >= right || top >= bottom)
+		return;
+
+	render->area.x = output->x + left;
+	render->area.y = output->y + top;
+	render->area.width = right - left;
+	render->area.height = bottom - top;
+}
 
-	switch (mode) {
-	case MODE_CENTER:
-		filter = PIXMAN_FILTER_FAST;
-		w_scale = 1;
-		h_scale = 1;
-		break;
+/*
+ * Stores d in i if it is an integer, apart from rounding errors.
+ */
+static int
+get_int(double d, int *i)
+{
+	if (d <= -(1 << 24) || d >= 1 << 24)
+		return 0;
+	*i = d < 0 ? (int)(d - 0.5) : (int)(d + 0.5);
+	return d - *i < 1e-6 && *i - d < 1e-6;
+}
+
+/*
+ * Returns the factor by which ftransform enlarges (positive) or reduces
+ * (negative) images if it is an integer and pixel edges stay aligned,
+ * otherwise 0.  A factor of 1 is an integer translation.  Offsets
+ * locate the upper left pixel of the output as expected by scale_band.
+ */
+static int
+get_factor(pixman_f_transform_t *ftransform, int *off_x, int *off_y)
+{
+	int factor, mul, x, y;
+
+	if (ftransform->m[0][1] != 0 || ftransform->m[1][0] != 0 ||
+	    ftransform->m[0][0] <= 0 || ftransform->m[1][1] <= 0)
+		return 0;
+
+	if (ftransform->m[0][0] > 0.5) {
+		if (!get_int(ftransform->m[0][0], &x) ||
+		    !get_int(ftransform->m[1][1], &y) || x != y)
+			return 0;
+		factor = x == 1 ? 1 : -x;
+		mul = 1;
+	} else {
+		if (!get_int(1 / ftransform->m[0][0], &x) ||
+		    !get_int(1 / ftransform->m[1][1], &y) || x != y)
+			return 0;
+		factor = mul = x;
+	}
+	if (!get_int(ftransform->m[0][2] * mul, off_x) ||
+	    !get_int(ftransform->m[1][2] * mul, off_y))
+		return 0;
+
+	/* blocks are only averaged for ratios of 2 and 4 */
+	if (factor < 0 && factor != -2 && factor != -4)
+		return 0;
+	return factor;
+}
+
+static void
+transform(wp_render_t *render)
+{
+	pixman_f_transform_t ftransform;
+	pixman_format_code_t format;
+	wp_buffer_t *buffer;
+	wp_option_t *option;
+	wp_output_t *output;
+	wp_target_t target;
+	int factor;
+
+	option = render->option;
+	output = render->output;
+	buffer = option->buffer;
+	target = (wp_target_t){
+		.width = output->width,
+		.height = output->height,
+		.mode = option->mode,
+		.trim = option->trim
+	};
+
+	if (option->mode == MODE_CENTER)
+		render->filter = PIXMAN_FILTER_FAST;
+
+	get_transform(&target, &buffer->info, &ftransform, 1);
+	/* image might have been scaled down and cropped while decoding */
+	if (buffer->denom != 1)
+		pixman_f_transform_scale(&ftransform, NULL,
+		    1.0 / buffer->denom, 1.0 / buffer->denom);
+	pixman_f_transform_translate(&ftransform, NULL,
+	    -buffer->region.x_off, -buffer->region.y_off);
+	pixman_transform_from_pixman_f_transform(&render->transform,
+	    &ftransform);
+
+	/*
+	 * Whole pixels are repeated or copied without interpolation.
+	 * Unless pixman only has to copy or convert them, kernels for 32
+	 * bit pixels take over.
+	 */
+	factor = get_factor(&ftransform, &render->off_x, &render->off_y);
+	if (factor > 0)
+		render->filter = PIXMAN_FILTER_NEAREST;
+	format = pixman_image_get_format(buffer->pixman_image);
+	if (factor == 1 || (factor != 0 &&
+	    (render->format == PIXMAN_x8r8g8b8 ||
+	    render->format == PIXMAN_a8r8g8b8) &&
+	    (format == PIXMAN_x8r8g8b8 || format == PIXMAN_a8r8g8b8)))
+		render->factor = factor;
+
+	/*
+	 * Images are halved while loading, so less than a factor of 2 is
+	 * left for reductions, which a bilinear filter would still alias.
+	 */
+	if (render->factor == 0 && render->filter == PIXMAN_FILTER_BEST &&
+	    (ftransform.m[0][0] > 1 || ftransform.m[1][1] > 1)) {
+		render->params = get_filter(ftransform.m[0][0],
+		    ftransform.m[1][1], &render->n_params);
+		if (render->params != NULL)
+			render->filter = PIXMAN_FILTER_SEPARABLE_CONVOLUTION;
+	}
+
+	/* cache entries contain whole outputs */
+	render->area = *output;
+	if (render->cache == NULL)
+		get_area(render, &ftransform);
+}
+
+static size_t
+prepare_output(xcb_connection_t *c, xcb_screen_t *screen, wp_output_t *output,
+    wp_job_t *job, wp_render_t *render)
+{
+	wp_option_t *option;
+	wp_output_t *area;
+	size_t bands, max_bands;
+	uint8_t depth;
+
+	option = job->option;
+	*render = (wp_render_t){
+		.output = output,
+		.area = *output,
+		.option = option,
+		.cache = job->cache
+	};
+	area = &render->area;
+
+	render->format = get_format(screen);
+	if (screen->root_depth == 30)
+		render->filter = PIXMAN_FILTER_NEAREST;
+	else
+		render->filter = PIXMAN_FILTER_BEST;
+
+	if (render->cache != NULL && render->cache->pixels != NULL)
+		debug("using cached %s for %s\n", option->filename,
+		    output->name != NULL ? output->name : "screen");
+	else if (option->mode != MODE_TILE)
+		transform(render);
+
+	depth = screen->root_depth == 16 ? 16 : 32;
+	/* rows of Z pixmaps and pixman images are padded to 32 bits */
+	SAFE_MUL(render->stride, area->width, depth / 8);
+	render->stride = (render->stride + 3) & ~(size_t)3;
+	SAFE_MUL(render->len, area->height, render->stride);
+
+#ifdef WITH_SHM
+	/* compose directly into memory shared with the X server */
+	render->pixels = create_shm(c, render->len, &render->shmseg);
+#endif /* WITH_SHM */
+	if (render->pixels == NULL) {
+		/* every band is sent with its own request */
+		render->band_height = get_max_rows_per_request(c,
+		    render->stride, 65536);
+		if (render->band_height > area->height)
+			render->band_height = area->height;
+	} else {
+		/* a few bands per thread for balancing */
+		bands = (size_t)get_threads() * 4;
+		max_bands = (area->height + MIN_BAND_HEIGHT - 1) /
+		    MIN_BAND_HEIGHT;
+		if (bands > max_bands)
+			bands = max_bands;
+		render->band_height = (area->height + bands - 1) / bands;
+	}
+	bands = (area->height + render->band_height - 1) /
+	    render->band_height;
+
+	debug("composing %s for %s (area %dx%d+%d+%d) (mode %d) "
+	    "in %zu band%s\n", option->filename,
+	    output->name != NULL ? output->name : "screen",
+	    area->width, area->height, area->x - output->x,
+	    area->y - output->y, option->mode, bands, bands == 1 ? "" : "s");
+
+	return bands;
+}
+
+/*
+ * Sends all pixels of img to pixmap, in as many requests as needed.
+ */
+static void
+put_pixman_image(xcb_connection_t *c, xcb_pixmap_t pixmap, uint8_t depth,
+    pixman_image_t *img)
+{
+	xcb_gcontext_t gc;
+	uint32_t max_height;
+	uint8_t *data;
+	int h, height, stride, width, y;
+
+	data = (uint8_t *)pixman_image_get_data(img);
+	width = pixman_image_get_width(img);
+	height = pixman_image_get_height(img);
+	stride = pixman_image_get_stride(img);
+	max_height = get_max_rows_per_request(c, stride, 65536);
+
+	gc = xcb_generate_id(c);
+	xcb_create_gc(c, gc, pixmap, 0, NULL);
+	for (y = 0; y < height; y += h) {
+		h = height - y;
+		if ((uint32_t)h > max_height)
+			h = max_height;
+		xcb_put_image(c, XCB_IMAGE_FORMAT_Z_PIXMAP, pixmap, gc,
+		    width, h, 0, y, 0, depth, (uint32_t)stride * h,
+		    data + (size_t)y * stride);
+	}
+	xcb_free_gc(c, gc);
+}
+
+/*
+ * Uploads the tile of a job once into a pixmap of its own, which the
+ * X server repeats across the output.  Outputs smaller than the tile
+ * only need its upper left part.  Outputs showing the same part of an
+ * image share the pixmap.
+ */
+static void
+prepare_tile(xcb_connection_t *c, xcb_screen_t *screen, wp_job_t *job,
+    wp_render_t *renders, size_t n)
+{
+	wp_render_t *render, *other;
+	wp_option_t *option;
+	wp_output_t *output;
+	wp_buffer_t *buffer;
+	wp_box_t box;
+	pixman_image_t *src, *dest;
+	size_t i;
+
+	render = &renders[n];
+	option = job->option;
+	output = job->output;
+	buffer = option->buffer;
+
+	if (option->trim == NULL)
+		box = (wp_box_t){
+			.width = buffer->info.width,
+			.height = buffer->info.height,
+			.x_off = 0,
+			.y_off = 0
+		};
+	else
+		box = *option->trim;
+	if (box.width > output->width)
+		box.width = output->width;
+	if (box.height > output->height)
+		box.height = output->height;
+
+	*render = (wp_render_t){
+		.output = output,
+		.area = *output,
+		.option = option,
+		.tile_box = box
+	};
+
+	for (i = 0; i < n; i++) {
+		other = &renders[i];
+		if (other->tile != XCB_NONE &&
+		    other->option->buffer == buffer &&
+		    other->tile_box.width == box.width &&
+		    other->tile_box.height == box.height &&
+		    other->tile_box.x_off == box.x_off &&
+		    other->tile_box.y_off == box.y_off) {
+			debug("reusing tile of %s (%dx%d+%d+%d) for %s\n",
+			    option->filename, box.width, box.height,
+			    box.x_off, box.y_off, output->name);
+			render->tile = other->tile;
+			return;
+		}
+	}
+
+	dest = pixman_image_create_bits(get_format(screen), box.width,
+	    box.height, NULL, 0);
+	if (dest == NULL)
+		errx(1, "failed to create temporary pixman image");
+	/* tiled images are never scaled, only cropped while decoding */
+	src = create_source(buffer);
+	pixman_image_composite(PIXMAN_OP_SRC, src, NULL, dest,
+	    box.x_off - buffer->region.x_off, box.y_off - buffer->region.y_off,
+	    0, 0, 0, 0, box.width, box.height);
+	pixman_image_unref(src);
+
+	render->tile = xcb_generate_id(c);
+	render->owner = 1;
+	xcb_create_pixmap(c, screen->root_depth, render->tile, screen->root,
+	    box.width, box.height);
+	debug("uploading tile of %s (%dx%d+%d+%d)\n", option->filename,
+	    box.width, box.height, box.x_off, box.y_off);
+	put_pixman_image(c, render->tile, screen->root_depth, dest);
+	pixman_image_unref(dest);
+}
+
+#ifdef WITH_RENDER
+/*
+ * Checks if job should be scaled by the X server, which is the case if
+ * it is enlarged.  Uploading the source is cheaper than uploading the
+ * output then.  Cached outputs need their pixels on client side.
+ * Reductions along one axis stay on client side as well, because RENDER
+ * lacks the convolution filter used for them.
+ */
+static int
+scale_on_server(xcb_connection_t *c, xcb_screen_t *screen, wp_job_t *job)
+{
+	pixman_f_transform_t ftransform;
+	wp_buffer_t *buffer;
+	wp_output_t *output;
+	wp_target_t target;
+
+	output = job->output;
+	buffer = job->option->buffer;
+	if (output == NULL || job->cache != NULL)
+		return 0;
+	switch (job->option->mode) {
+	case MODE_FOCUS:
 	case MODE_MAXIMIZE:
-		scale = w_scale < h_scale ? h_scale : w_scale;
-		w_scale = scale;
-		h_scale = scale;
-		break;
+	case MODE_STRETCH:
 	case MODE_ZOOM:
-		scale = w_scale > h_scale ? h_scale : w_scale;
-		w_scale = scale;
-		h_scale = scale;
-	default:
 		break;
+	default:
+		return 0;
 	}
+	if ((uint64_t)buffer->region.width * buffer->region.height >=
+	    (uint64_t)output->width * output->height)
+		return 0;
+
+	target = (wp_target_t){
+		.width = output->width,
+		.height = output->height,
+		.mode = job->option->mode,
+		.trim = job->option->trim
+	};
+	get_transform(&target, &buffer->info, &ftransform, 0);
+	if (ftransform.m[0][0] > buffer->denom ||
+	    ftransform.m[1][1] > buffer->denom)
+		return 0;
+
+	return init_render(c, screen);
+}
 
-	translate_x = (src_width / w_scale - xcb_width) / 2 + off_x / w_scale;
-	translate_y = (src_height / h_scale - xcb_height) / 2 + off_y / h_scale;
+/*
+ * Uploads the decoded region of a job once as a picture, which the X
+ * server scales into outputs.  Outputs of the same image share it.
+ */
+static void
+prepare_picture(xcb_connection_t *c, xcb_screen_t *screen, wp_job_t *job,
+    wp_render_t *renders, size_t n)
+{
+	wp_render_t *render;
+	wp_buffer_t *buffer;
+	pixman_image_t *src, *argb;
+	xcb_pixmap_t pixmap;
+	size_t i;
+
+	render = &renders[n];
+	buffer = job->option->buffer;
+	*render = (wp_render_t){
+		.output = job->output,
+		.option = job->option
+	};
+	if (screen->root_depth == 30)
+		render->filter = PIXMAN_FILTER_NEAREST;
+	else
+		render->filter = PIXMAN_FILTER_BEST;
+	transform(render);
+
+	for (i = 0; i < n; i++)
+		if (renders[i].picture != XCB_NONE &&
+		    renders[i].option->buffer == buffer) {
+			render->picture = renders[i].picture;
+			return;
+		}
 
-	pixman_f_transform_init_translate(&ftransform,
-	    translate_x, translate_y);
-	if (option->mode != MODE_CENTER)
-		pixman_f_transform_scale(&ftransform, NULL, w_scale, h_scale);
-	pixman_image_set_filter(pixman_image, filter, NULL, 0);
-	pixman_transform_from_pixman_f_transform(&transform, &ftransform);
-	pixman_image_set_transform(pixman_image, &transform);
+	src = buffer->pixman_image;
+	if (pixman_image_get_format(src) == PIXMAN_a8r8g8b8)
+		argb = pixman_image_ref(src);
+	else {
+		argb = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+		    buffer->region.width, buffer->region.height, NULL, 0);
+		if (argb == NULL)
+			errx(1, "failed to create temporary pixman image");
+		src = create_source(buffer);
+		pixman_image_composite(PIXMAN_OP_SRC, src, NULL, argb,
+		    0, 0, 0, 0, 0, 0, buffer->region.width,
+		    buffer->region.height);
+		pixman_image_unref(src);
+	}
 
-	debug("composing %s for %s (area %dx%d+%d+%d) (mode %d)\n",
-	    option->filename, output->name != NULL ? output->name : "screen",
-	    output->width, output->height, 0, 0, option->mode);
-	pixman_image_composite(PIXMAN_OP_CONJOINT_SRC, pixman_image, NULL, dest,
-	    0, 0, 0, 0, 0, 0, output->width, output->height);
+	debug("uploading %s (%dx%d+%d+%d) for scaling on server side\n",
+	    job->option->filename, buffer->region.width,
+	    buffer->region.height, buffer->region.x_off,
+	    buffer->region.y_off);
+	pixmap = xcb_generate_id(c);
+	xcb_create_pixmap(c, 32, pixmap, screen->root, buffer->region.width,
+	    buffer->region.height);
+	put_pixman_image(c, pixmap, 32, argb);
+	pixman_image_unref(argb);
+
+	/* picture keeps the pixmap alive */
+	render->picture = create_picture(c, pixmap);
+	render->owner = 1;
+	xcb_free_pixmap(c, pixmap);
 }
+#endif /* WITH_RENDER */
 
 static void
-put_wallpaper(xcb_connection_t *c, xcb_screen_t *screen, wp_output_t *output,
-    xcb_image_t *xcb_image, xcb_pixmap_t pixmap, xcb_gcontext_t gc)
+fill_tile(xcb_connection_t *c, xcb_pixmap_t pixmap, wp_render_t *render)
 {
-	uint8_t *data;
-	uint32_t h, max_height, row_len, sub_height;
-	xcb_image_t *sub;
-	uint8_t depth;
+	wp_output_t *output;
+	xcb_gcontext_t gc;
+	xcb_rectangle_t rectangle;
+	uint32_t values[4];
+
+	output = render->output;
+
+	/* tiles start at the upper left corner of the output */
+	values[0] = XCB_FILL_STYLE_TILED;
+	values[1] = render->tile;
+	values[2] = (uint32_t)output->x;
+	values[3] = (uint32_t)output->y;
+	gc = xcb_generate_id(c);
+	xcb_create_gc(c, gc, pixmap, XCB_GC_FILL_STYLE | XCB_GC_TILE |
+	    XCB_GC_TILE_STIPPLE_ORIGIN_X | XCB_GC_TILE_STIPPLE_ORIGIN_Y,
+	    values);
+
+	rectangle = (xcb_rectangle_t){
+		.x = output->x,
+		.y = output->y,
+		.width = output->width,
+		.height = output->height
+	};
+	debug("tiling %s for %s (area %dx%d+%d+%d) on server side\n",
+	    render->option->filename, output->name, output->width,
+	    output->height, output->x, output->y);
+	xcb_poly_fill_rectangle(c, pixmap, gc, 1, &rectangle);
+	xcb_free_gc(c, gc);
+}
 
-	depth = screen->root_depth == 16 ? 16 : 32;
+static int
+intersects(wp_output_t *a, wp_output_t *b)
+{
+	return a->x < b->x + b->width && b->x < a->x + a->width &&
+	    a->y < b->y + b->height && b->y < a->y + a->height;
+}
 
-	debug("xcb image (%dx%d) to %s (%dx%d+%d+%d)\n",
-	    xcb_image->width, xcb_image->height,
-	    output->name != NULL ? output->name : "screen", output->width,
-	    output->height, output->x, output->y);
+/*
+ * Finds an output which has been composed exactly like job would be,
+ * i.e. same image, mode, trim box and size.  Its area must not have
+ * been drawn over by outputs in between.
+ */
+static wp_render_t *
+find_twin(wp_render_t *renders, size_t n, wp_job_t *job)
+{
+	wp_render_t *render;
+	wp_option_t *a, *b;
+	size_t i, j;
+
+	if (job->output == NULL)
+		return NULL;
+
+	a = job->option;
+	for (i = 0; i < n; i++) {
+		render = &renders[i];
+		b = render->option;
+		if (render->twin != NULL || render->tile != XCB_NONE ||
+		    b->buffer != a->buffer || b->mode != a->mode ||
+		    render->output->width != job->output->width ||
+		    render->output->height != job->output->height)
+			continue;
+		if ((a->trim == NULL) != (b->trim == NULL) ||
+		    (a->trim != NULL &&
+		    memcmp(a->trim, b->trim, sizeof(*a->trim)) != 0))
+			continue;
+		for (j = i + 1; j < n; j++)
+			if (intersects(render->output, renders[j].output))
+				break;
+		if (j == n)
+			return render;
+	}
+	return NULL;
+}
+
+static void
+copy_twin(xcb_connection_t *c, xcb_pixmap_t pixmap, xcb_gcontext_t gc,
+    wp_render_t *render)
+{
+	wp_output_t *from, *to;
+
+	/* borders are filled later on */
+	from = &render->twin->area;
+	to = &render->area;
+	debug("copying %s from %s to %s (area %dx%d+%d+%d)\n",
+	    render->option->filename, from->name, to->name, to->width,
+	    to->height, to->x, to->y);
+	xcb_copy_area(c, pixmap, pixmap, gc, from->x, from->y, to->x, to->y,
+	    to->width, to->height);
+}
 
-	max_height = get_max_rows_per_request(c, xcb_image, UINT32_MAX / 4);
-	if (max_height < xcb_image->height) {
-		debug("image exceeds request size limitations\n");
+/*
+ * Updates black region after drawing an output: its borders are black
+ * now, unless covered by the image area later on.
+ */
+static void
+cover(pixman_region32_t *black, wp_output_t *output, wp_output_t *area)
+{
+	pixman_region32_t image;
+
+	pixman_region32_union_rect(black, black, output->x, output->y,
+	    output->width, output->height);
+	pixman_region32_init_rect(&image, area->x, area->y, area->width,
+	    area->height);
+	pixman_region32_subtract(black, black, &image);
+	pixman_region32_fini(&image);
+}
 
-		/* adjust for better performance */
-		max_height = get_max_rows_per_request(c, xcb_image, 65536);
+static void
+draw_on_server(xcb_connection_t *c, xcb_screen_t *screen, xcb_pixmap_t pixmap,
+    xcb_gcontext_t gc, wp_render_t *render)
+{
+	if (render->tile != XCB_NONE)
+		fill_tile(c, pixmap, render);
+	else if (render->twin != NULL)
+		copy_twin(c, pixmap, gc, render);
+#ifdef WITH_RENDER
+	else if (render->picture != XCB_NONE)
+		scale_picture(c, screen, render->picture, pixmap,
+		    render->output, &render->area, &render->transform,
+		    render->filter);
+#endif /* WITH_RENDER */
+}
 
-		sub_height = max_height;
-		sub = xcb_image_create_native(c, xcb_image->width, sub_height,
-		    XCB_IMAGE_FORMAT_Z_PIXMAP, depth, NULL, ~0, NULL);
-		if (sub == NULL)
-			errx(1, "failed to create xcb image");
-	} else {
-		sub = xcb_image;
-		sub_height = xcb_image->height;
-	}
-
-	row_len = (xcb_image->stride + xcb_image->scanline_pad - 1) &
-	    -xcb_image->scanline_pad;
-
-	data = xcb_image->data;
-	for (h = 0; h < xcb_image->height; h += sub_height) {
-		if (sub_height > xcb_image->height - h) {
-			sub_height = xcb_image->height - h;
-			xcb_image_destroy(sub);
-			sub = xcb_image_create_native(c,
-			    xcb_image->width, sub_height,
-			    XCB_IMAGE_FORMAT_Z_PIXMAP, depth, NULL, ~0, NULL);
-			if (sub == NULL)
-				errx(1, "failed to create xcb image");
+static void
+upload_band(xcb_connection_t *c, xcb_screen_t *screen, wp_band_t *band,
+    xcb_pixmap_t pixmap, xcb_gcontext_t gc)
+{
+	wp_output_t *output;
+	wp_render_t *render;
+
+	render = band->render;
+	/* borders around the image are not sent */
+	output = &render->area;
+
+#ifdef WITH_SHM
+	if (render->pixels != NULL) {
+		/* whole area is sent after its last band */
+		if (band->y + band->height == output->height) {
+			if (render->cache != NULL)
+				write_cache(render->cache, render->pixels,
+				    render->len);
+			put_shm(c, screen, output, pixmap, gc,
+			    render->shmseg);
+			free_shm(c, render->pixels, render->len,
+			    render->shmseg);
 		}
+		return;
+	}
+#endif /* WITH_SHM */
+
+	debug("put image (%dx%d+0+%d) to %s (%dx%d+%d+%d)\n",
+	    output->width, band->height, band->y,
+	    output->name != NULL ? output->name : "screen",
+	    output->width, band->height, output->x, output->y + band->y);
+	/* data is written to the connection before this returns */
+	xcb_put_image(c, XCB_IMAGE_FORMAT_Z_PIXMAP, pixmap, gc,
+	    output->width, band->height, output->x, output->y + band->y, 0,
+	    screen->root_depth, render->stride * band->height, band->data);
+	if (render->cache != NULL)
+		write_cache(render->cache, band->data,
+		    render->stride * band->height);
+}
 
-		debug("put image (%dx%d+0+%d) to %s (%dx%d+%d+%d)\n",
-		    sub->width, sub->height, h,
-		    output->name != NULL ? output->name : "screen",
-		    sub->width, sub_height, output->x,
-		    output->y + h);
-		xcb_put_image(c, sub->format, pixmap, gc,
-		    sub->width, sub->height, output->x,
-		    output->y + h, 0, screen->root_depth,
-		    sub->size, data);
+#ifdef WITH_RANDR
+/*
+ * Marks screen of a RandR event as changed.  Returns the screen or NULL
+ * if event is of no interest.
+ */
+static xcb_screen_t *
+note_event(xcb_connection_t *c, xcb_generic_event_t *event)
+{
+	xcb_randr_screen_change_notify_event_t *screen_event;
+	xcb_randr_notify_event_t *notify_event;
+	const xcb_query_extension_reply_t *reply;
+	xcb_screen_iterator_t it;
+	xcb_window_t root;
+	uint8_t type;
+	int snum;
+
+	debug("event received: response_type=%u, sequence=%u\n",
+	    event->response_type, event->sequence);
+	reply = xcb_get_extension_data(c, &xcb_randr_id);
+	type = event->response_type & ~0x80;
+	screen_event = NULL;
+	if (type == reply->first_event + XCB_RANDR_SCREEN_CHANGE_NOTIFY) {
+		screen_event = (xcb_randr_screen_change_notify_event_t *)event;
+		root = screen_event->root;
+	} else if (type == reply->first_event + XCB_RANDR_NOTIFY) {
+		notify_event = (xcb_randr_notify_event_t *)event;
+		if (notify_event->subCode == XCB_RANDR_NOTIFY_CRTC_CHANGE)
+			root = notify_event->u.cc.window;
+		else if (notify_event->subCode ==
+		    XCB_RANDR_NOTIFY_OUTPUT_CHANGE)
+			root = notify_event->u.oc.window;
+		else
+			return NULL;
+	} else
+		return NULL;
 
-		data += row_len * sub_height;
+	it = xcb_setup_roots_iterator(xcb_get_setup(c));
+	for (snum = 0; it.rem; snum++, xcb_screen_next(&it)) {
+		if (it.data->root != root)
+			continue;
+		if (screen_event != NULL) {
+			it.data->width_in_pixels = screen_event->width;
+			it.data->height_in_pixels = screen_event->height;
+		}
+		changed[snum] = 1;
+		return it.data;
 	}
+	return NULL;
+}
 
-	if (sub != xcb_image)
-		xcb_image_destroy(sub);
+/*
+ * Notes all pending events.  Returns 1 if screen changed, i.e. drawing
+ * it with current layout is a waste of time.
+ */
+static int
+poll_events(xcb_connection_t *c, xcb_screen_t *screen)
+{
+	xcb_generic_event_t *event;
+	int ret;
+
+	ret = 0;
+	while ((event = xcb_poll_for_event(c)) != NULL) {
+		if (note_event(c, event) == screen && screen != NULL)
+			ret = 1;
+		free(event);
+	}
+	return ret;
 }
+#endif /* WITH_RANDR */
 
-static void
-process_output(xcb_connection_t *c, xcb_screen_t *screen, wp_output_t *output,
-    wp_option_t *option, xcb_pixmap_t pixmap, xcb_gcontext_t gc)
+/*
+ * Composes all outputs of a screen concurrently.  Only the calling
+ * thread talks to the X server, uploading bands in order as soon as
+ * they are finished, so overlapping outputs keep their stacking.
+ *
+ * Bands which are sent with PutImage are composed into a ring of
+ * buffers.  A band is only released for composition when the band
+ * which used its buffer before has been sent, so the ring bounds the
+ * number of bands composed ahead of the X server.
+ *
+ * Only image areas are drawn, black is the region which has to be
+ * filled afterwards.
+ */
+static int
+process_outputs(xcb_connection_t *c, xcb_screen_t *screen, wp_plan_t *plan,
+    wp_output_t *tile_output, xcb_pixmap_t pixmap, xcb_gcontext_t gc,
+    pixman_region32_t *black)
 {
-	uint32_t *pixels;
-	size_t len, stride;
-	xcb_image_t *xcb_image;
-	pixman_image_t *pixman_image;
-	pixman_format_code_t pixman_format;
-	pixman_filter_t filter;
-	uint8_t depth;
+	/* ring buffer is kept for all screens and daemon events */
+	static uint8_t *ring;
+	static size_t ring_len;
+	wp_render_t *renders, *render, *twin;
+	wp_band_t *bands;
+	wp_job_t *job;
+	pixman_image_t **images;
+	size_t count, i, len, n, nimages, nrenders, r, slot_len, slots;
+	int aborted, y;
+
+	if (plan->count == 0)
+		return 0;
+
+	SAFE_MUL(len, plan->count, sizeof(*renders));
+	renders = xmalloc(len);
+	count = 0;
+	nrenders = 0;
+	slot_len = 0;
+	for (i = 0; i < plan->count; i++) {
+		job = &plan->jobs[i];
+		/* still shown by pixmap */
+		if (job->output != NULL && job->output->keep)
+			continue;
+		render = &renders[nrenders];
+		if (job->output != NULL && job->option->mode == MODE_TILE) {
+			prepare_tile(c, screen, job, renders, nrenders);
+			n = 0;
+		} else if ((twin = find_twin(renders, nrenders, job)) != NULL) {
+			*render = (wp_render_t){
+				.output = job->output,
+				.area = twin->area,
+				.option = job->option,
+				.twin = twin
+			};
+			render->area.x += job->output->x - twin->output->x;
+			render->area.y += job->output->y - twin->output->y;
+			render->area.name = job->output->name;
+			n = 0;
+#ifdef WITH_RENDER
+		} else if (scale_on_server(c, screen, job)) {
+			prepare_picture(c, screen, job, renders, nrenders);
+			n = 0;
+#endif /* WITH_RENDER */
+		} else
+			n = prepare_output(c, screen, job->output != NULL ?
+			    job->output : tile_output, job, render);
+		nrenders++;
+		cover(black, render->output, &render->area);
+		if (SIZE_MAX - count < n)
+			errx(1, "too many bands");
+		render->first = count;
+		count += n;
+		render->last = count;
+		if (render->pixels == NULL && (render->cache == NULL ||
+		    render->cache->pixels == NULL) &&
+		    slot_len < render->stride * render->band_height)
+			slot_len = render->stride * render->band_height;
+	}
+	if (nrenders == 0) {
+		free(renders);
+		return 0;
+	}
 
-	depth = screen->root_depth == 16 ? 16 : 32;
-	SAFE_MUL(stride, output->width, depth / 8);
-	SAFE_MUL(len, output->height, stride);
-	pixels = xmalloc(len);
-
-	switch (screen->root_depth) {
-	case 16:
-		pixman_format = PIXMAN_r5g6b5;
-		filter = PIXMAN_FILTER_BEST;
-		break;
-	case 30:
-		pixman_format = PIXMAN_x2r10g10b10;
-		filter = PIXMAN_FILTER_NEAREST;
-		break;
-	default:
-		pixman_format = PIXMAN_x8r8g8b8;
-		filter = PIXMAN_FILTER_BEST;
-		break;
+	/* enough bands in flight to keep every thread busy */
+	slots = (size_t)get_threads() * 2;
+	SAFE_MUL(len, slots, slot_len);
+	if (len > ring_len) {
+		free(ring);
+		ring = xmalloc(len);
+		ring_len = len;
 	}
 
-	pixman_image = pixman_image_create_bits(pixman_format, output->width,
-	    output->height, pixels, stride);
-	if (pixman_image == NULL)
-		errx(1, "failed to create temporary pixman image");
+	SAFE_MUL3(len, nrenders, slots, 2 * sizeof(*images));
+	images = xmalloc(len);
+	for (i = 0; i < nrenders * slots * 2; i++)
+		images[i] = NULL;
+
+	/* outputs might all be tiled on server side */
+	SAFE_MUL(len, count, sizeof(*bands));
+	bands = count > 0 ? xmalloc(len) : NULL;
+	for (i = 0, n = 0; i < nrenders; i++) {
+		render = &renders[i];
+		render->images = &images[i * slots * 2];
+		for (y = 0; n < render->last; n++) {
+			bands[n].render = render;
+			bands[n].slot = n % slots;
+			bands[n].y = y;
+			bands[n].height = render->area.height - y;
+			if (bands[n].height > render->band_height)
+				bands[n].height = render->band_height;
+			if (render->pixels != NULL)
+				bands[n].data = render->pixels +
+				    (size_t)y * render->stride;
+			else if (render->cache != NULL &&
+			    render->cache->pixels != NULL)
+				bands[n].data = render->cache->pixels +
+				    (size_t)y * render->stride;
+			else
+				bands[n].data = ring + bands[n].slot * slot_len;
+			y += bands[n].height;
+		}
+	}
 
-	if (option->mode == MODE_TILE)
-		tile(pixman_image, output, option);
-	else
-		transform(pixman_image, output, option, filter);
+	aborted = 0;
+	r = 0;
+	start_tasks(compose_band, bands, count, slots);
+	for (n = 0; n < count; n++) {
+		/* server side drawing keeps order of outputs as well */
+		for (; r < nrenders && renders[r].first <= n; r++)
+			draw_on_server(c, screen, pixmap, gc, &renders[r]);
+#ifdef WITH_RANDR
+		if (changed != NULL && poll_events(c, screen)) {
+			/* bands which are not released yet are skipped */
+			for (i = n + slots; i < count; i++)
+				bands[i].height = 0;
+			release_tasks(count);
+			wait_tasks(count);
+			debug("aborted after %zu of %zu bands\n", n, count);
+			aborted = 1;
+			break;
+		}
+#endif /* WITH_RANDR */
+		wait_tasks(n + 1);
+		upload_band(c, screen, &bands[n], pixmap, gc);
+		release_tasks(n + 1 + slots);
+	}
+	if (!aborted)
+		for (; r < nrenders; r++)
+			draw_on_server(c, screen, pixmap, gc, &renders[r]);
+#ifdef WITH_SHM
+	/* segments are otherwise released after their last band */
+	if (aborted)
+		for (i = 0; i < nrenders; i++)
+			if (renders[i].pixels != NULL && renders[i].last > n)
+				free_shm(c, renders[i].pixels, renders[i].len,
+				    renders[i].shmseg);
+#endif /* WITH_SHM */
+
+	/* stores new cache entries */
+	for (i = 0; i < plan->count; i++) {
+		close_cache(plan->jobs[i].cache);
+		plan->jobs[i].cache = NULL;
+	}
 
-	xcb_image = xcb_image_create_native(c, output->width, output->height,
-	    XCB_IMAGE_FORMAT_Z_PIXMAP, depth, NULL, len, (uint8_t *) pixels);
-	if (xcb_image == NULL)
-		errx(1, "failed to create xcb image");
+	for (i = 0; i < nrenders; i++) {
+		if (!renders[i].owner)
+			continue;
+		if (renders[i].tile != XCB_NONE)
+			xcb_free_pixmap(c, renders[i].tile);
+#ifdef WITH_RENDER
+		if (renders[i].picture != XCB_NONE)
+			free_picture(c, renders[i].picture);
+#endif /* WITH_RENDER */
+	}
 
-	put_wallpaper(c, screen, output, xcb_image, pixmap, gc);
+	nimages = 0;
+	for (i = 0; i < nrenders * slots * 2; i++)
+		if (images[i] != NULL) {
+			pixman_image_unref(images[i]);
+			nimages++;
+		}
+	free_filters();
+	debug("composed and sent %zu bands with %zu temporary images\n",
+	    n, nimages);
 
-	xcb_image_destroy(xcb_image);
-	pixman_image_unref(pixman_image);
-	free(pixels);
+	free(bands);
+	free(images);
+	free(renders);
+
+	return aborted;
 }
 
 static void
@@ -529,10 +1534,13 @@ process_atoms(xcb_connection_t *c, xcb_screen_t *screen, xcb_pixmap_t *pixmap,
 			old[i] = NULL;
 	}
 
-	if (old[0] != NULL && pixmap != NULL && *old[0] != *pixmap) {
+	/* pixmaps of remembered layouts are still needed */
+	if (old[0] != NULL && pixmap != NULL && *old[0] != *pixmap &&
+	    !is_layout(*old[0])) {
 		delete(c, *old[0]);
 	}
-	if (old[1] != NULL && (old[0] == NULL || *old[0] != *old[1])) {
+	if (old[1] != NULL && (old[0] == NULL || *old[0] != *old[1]) &&
+	    !is_layout(*old[1])) {
 		delete(c, *old[1]);
 	}
 	if (pixmap != NULL) {
@@ -568,30 +1576,37 @@ process_atoms(xcb_connection_t *c, xcb_screen_t *screen, xcb_pixmap_t *pixmap,
 	}
 }
 
-static void
-process_screen(xcb_connection_t *c, xcb_screen_t *screen, int snum,
-    wp_config_t *config)
+/*
+ * Draws the wallpaper of screen.  Kept outputs are taken from pixmap
+ * prev, which shows the previous wallpaper in daemon mode.
+ *
+ * Returns 1 if drawing was aborted due to a newer layout.
+ */
+static int
+process_screen(xcb_connection_t *c, xcb_screen_t *screen, wp_config_t *config,
+    wp_plan_t *plan, xcb_pixmap_t prev)
 {
+#ifdef WITH_RANDR
+	xcb_pixmap_t saved;
+#endif /* WITH_RANDR */
 	xcb_pixmap_t pixmap, result;
 	xcb_gcontext_t gc;
 	xcb_get_geometry_cookie_t geom_cookie;
 	xcb_get_geometry_reply_t *geom_reply;
-	wp_output_t *outputs, tile_output;
-	wp_option_t *opt, *options;
+	wp_output_t tile_output, *output;
 	uint16_t width, height;
-	xcb_rectangle_t rectangle;
-	int created;
-
-	options = config->options;
-
-	/* let X perform non-randr tiling if requested */
-	if (options != NULL && options[0].mode == MODE_TILE &&
-	    options[0].output == NULL && options[1].filename == NULL) {
-		pixman_image_t *pixman_image = options->buffer->pixman_image;
-
-		/* fake an output that fits the picture */
-		width = pixman_image_get_width(pixman_image);
-		height = pixman_image_get_height(pixman_image);
+	xcb_rectangle_t *rectangles;
+	pixman_region32_t black;
+	pixman_box32_t *boxes;
+	/* copies must not generate events */
+	uint32_t exposures = 0;
+	size_t len;
+	int created, i, moved, n;
+
+	if (plan->outputs == NULL) {
+		/* fake an output that fits the picture for X tiling */
+		width = config->options[0].buffer->info.width;
+		height = config->options[0].buffer->info.height;
 		tile_output = (wp_output_t){
 			.x = 0,
 			.y = 0,
@@ -599,11 +1614,9 @@ process_screen(xcb_connection_t *c, xcb_screen_t *screen, int snum,
 			.height = height,
 			.name = NULL
 		};
-		outputs = &tile_output;
 	} else {
 		width = screen->width_in_pixels;
 		height = screen->height_in_pixels;
-		outputs = get_outputs(c, screen);
 	}
 
 	if (config->source == SOURCE_ATOMS) {
@@ -620,10 +1633,24 @@ process_screen(xcb_connection_t *c, xcb_screen_t *screen, int snum,
 	} else
 		pixmap = XCB_BACK_PIXMAP_NONE;
 
+	/* moved outputs would overwrite each other within one pixmap */
+	moved = 0;
+	for (output = plan->outputs; output != NULL && output->name != NULL;
+	    output++)
+		if (output->keep && (output->x != output->old_x ||
+		    output->y != output->old_y))
+			moved = 1;
+	if (prev != XCB_BACK_PIXMAP_NONE && (pixmap != prev || moved))
+		pixmap = XCB_BACK_PIXMAP_NONE;
+	/* remembered layouts are shown again as they are */
+	if (pixmap != XCB_BACK_PIXMAP_NONE && is_layout(pixmap))
+		pixmap = XCB_BACK_PIXMAP_NONE;
+
 	if (pixmap == XCB_BACK_PIXMAP_NONE) {
 		debug("creating pixmap (%dx%d)\n", width, height);
 		pixmap = xcb_generate_id(c);
 #ifdef WITH_RANDR
+		saved = created_pixmap;
 		if (config->daemon && (config->target & TARGET_ATOMS) &&
 		    !xcb_connection_has_error(c))
 			created_pixmap = pixmap;
@@ -631,43 +1658,72 @@ process_screen(xcb_connection_t *c, xcb_screen_t *screen, int snum,
 		xcb_create_pixmap(c, screen->root_depth, pixmap, screen->root,
 		    width, height);
 		gc = xcb_generate_id(c);
-		xcb_create_gc(c, gc, pixmap, 0, NULL);
-		rectangle = (xcb_rectangle_t){
-			.x = 0,
-			.y = 0,
-			.width = width,
-			.height = height
-		};
-		xcb_poly_fill_rectangle(c, pixmap, gc, 1, &rectangle);
+		xcb_create_gc(c, gc, pixmap, XCB_GC_GRAPHICS_EXPOSURES,
+		    &exposures);
+		/* cleared after drawing, except for image areas */
+		pixman_region32_init_rect(&black, 0, 0, width, height);
 		created = 1;
 	} else {
 		debug("reusing atom pixmap (%dx%d)\n", width, height);
 		gc = xcb_generate_id(c);
-		xcb_create_gc(c, gc, pixmap, 0, NULL);
+		xcb_create_gc(c, gc, pixmap, XCB_GC_GRAPHICS_EXPOSURES,
+		    &exposures);
+		pixman_region32_init(&black);
 		created = 0;
 	}
 
-	for (opt = options; opt != NULL && opt->filename != NULL; opt++) {
-		wp_output_t *output;
-
-		/* ignore options which are not relevant for this screen */
-		if (opt->screen != -1 && opt->screen != snum)
-			continue;
-
-		if (opt->output != NULL &&
-		    strcmp(opt->output, "all") == 0)
-			for (output = outputs; output->name != NULL; output++)
-				process_output(c, screen, output, opt,
-				    pixmap, gc);
-		else {
-			output = get_output(outputs, opt->output);
-			if (output != NULL)
-				process_output(c, screen, output, opt,
-				    pixmap, gc);
+	/* relocate kept outputs on server side */
+	if (prev != XCB_BACK_PIXMAP_NONE && pixmap != prev)
+		for (output = plan->outputs;
+		    output != NULL && output->name != NULL; output++)
+			if (output->keep) {
+				debug("copying output %s from %d,%d to %d,%d\n",
+				    output->name, output->old_x, output->old_y,
+				    output->x, output->y);
+				xcb_copy_area(c, prev, pixmap, gc,
+				    output->old_x, output->old_y,
+				    output->x, output->y,
+				    output->width, output->height);
+			}
+	for (output = plan->outputs; output != NULL && output->name != NULL;
+	    output++)
+		if (output->keep)
+			cover(&black, output, output);
+
+	if (process_outputs(c, screen, plan, &tile_output, pixmap, gc,
+	    &black)) {
+		pixman_region32_fini(&black);
+		xcb_free_gc(c, gc);
+		if (created) {
+			xcb_free_pixmap(c, pixmap);
+#ifdef WITH_RANDR
+			created_pixmap = saved;
+#endif /* WITH_RANDR */
 		}
+		/* previous wallpaper is still shown, unless drawn over */
+		plan->pixmap = pixmap == prev ? XCB_BACK_PIXMAP_NONE : prev;
+		return 1;
+	}
+
+	/* borders and uncovered areas with one request */
+	boxes = pixman_region32_rectangles(&black, &n);
+	if (n > 0) {
+		SAFE_MUL(len, (size_t)n, sizeof(*rectangles));
+		rectangles = xmalloc(len);
+		for (i = 0; i < n; i++)
+			rectangles[i] = (xcb_rectangle_t){
+				.x = boxes[i].x1,
+				.y = boxes[i].y1,
+				.width = boxes[i].x2 - boxes[i].x1,
+				.height = boxes[i].y2 - boxes[i].y1
+			};
+		debug("filling %d black rectangle%s\n", n, n == 1 ? "" : "s");
+		xcb_poly_fill_rectangle(c, pixmap, gc, n, rectangles);
+		free(rectangles);
 	}
+	pixman_region32_fini(&black);
 
-	if (options == NULL)
+	if (config->options == NULL)
 		result = XCB_BACK_PIXMAP_NONE;
 	else
 		result = pixmap;
@@ -688,63 +1744,246 @@ process_screen(xcb_connection_t *c, xcb_screen_t *screen, int snum,
 		if (created)
 			xcb_set_close_down_mode(c,
 			    XCB_CLOSE_DOWN_RETAIN_PERMANENT);
-	} else
-		xcb_free_pixmap(c, pixmap);
+		plan->pixmap = result;
+	} else {
+		if (prev != XCB_BACK_PIXMAP_NONE && prev != pixmap &&
+		    !is_layout(prev))
+			xcb_free_pixmap(c, prev);
+		/* root window keeps it alive anyway */
+		if (config->daemon && result != XCB_BACK_PIXMAP_NONE)
+			plan->pixmap = result;
+		else
+			xcb_free_pixmap(c, pixmap);
+	}
 	xcb_request_check(c, xcb_clear_area(c, 0, screen->root, 0, 0, 0, 0));
 
-	if (outputs != &tile_output)
-		free_outputs(outputs);
+	return 0;
+}
+
+static int
+convert_image(char *input, char *output)
+{
+	wp_buffer_t buffer;
+	wp_box_t region;
+	struct stat st;
+	FILE *fp;
+	int fd;
+
+	buffer = (wp_buffer_t){ .denom = 1 };
+	if ((fd = open(input, O_RDONLY)) == -1)
+		err(1, "failed to open %s", input);
+	if (fstat(fd, &st))
+		err(1, "failed to stat %s", input);
+	buffer.st_size = st.st_size;
+	map_buffer(&buffer, fd, input);
+	close(fd);
+	if (probe_image(buffer.data, buffer.len, &buffer.info))
+		errx(1, "failed to parse %s", input);
+	/* XPM colors depend on the screen */
+	if (buffer.info.format != FORMAT_JPEG &&
+	    buffer.info.format != FORMAT_PNG)
+		errx(1, "%s is neither PNG nor JPEG", input);
+	if (buffer.info.width == 0 || buffer.info.height == 0 ||
+	    buffer.info.height > UINT16_MAX || buffer.info.width > UINT16_MAX)
+		errx(1, "%s has illegal dimensions", input);
+	if ((uint64_t)buffer.info.width * buffer.info.height > PIXEL_BUDGET)
+		errx(1, "%s exceeds pixel budget", input);
+
+	region = (wp_box_t){
+		.width = buffer.info.width,
+		.height = buffer.info.height
+	};
+	buffer.pixman_image = load_pixman_image(NULL, NULL, &buffer, &region);
+	if (buffer.pixman_image == NULL)
+		errx(1, "failed to parse %s", input);
+	unmap_buffer(&buffer);
+
+	if ((fp = fopen(output, "wb")) == NULL)
+		err(1, "failed to open %s", output);
+	if (write_raw(fp, buffer.pixman_image) || fclose(fp))
+		err(1, "failed to write %s", output);
+	pixman_image_unref(buffer.pixman_image);
+
+	return 0;
 }
 
+#ifdef HAVE_PLEDGE
+/*
+ * Returns 1 if files are created, which is only done by the cache and
+ * by conversion into raw images.
+ */
+static int
+creates_files(int argc, char *argv[])
+{
+	int i;
+
+	if (argc == 4 && strcmp(argv[1], "--convert") == 0)
+		return 1;
+	for (i = 1; i < argc; i++)
+		if (strcmp(argv[i], "--cache") == 0)
+			return 1;
+	return 0;
+}
+#endif /* HAVE_PLEDGE */
+
 static void
 usage(void)
 {
 	fprintf(stderr,
-"usage: xwallpaper [--screen <screen>] [--clear] [--daemon] [--debug]\n"
-"  [--no-atoms] [--no-randr] [--no-root] [--trim widthxheight[+x+y]]\n"
-"  [--output <output>] [--center <file>] [--focus <file>]\n"
-"  [--maximize <file>] [--stretch <file>] [--tile <file>] [--zoom <file>]\n"
-"  [--version]\n");
+"usage: xwallpaper [--screen <screen>] [--cache] [--clear] [--daemon]\n"
+"  [--debug] [--layouts <count>] [--layout-memory <MB>] [--no-atoms]\n"
+"  [--no-randr] [--no-root]\n"
+"  [--trim widthxheight[+x+y]] [--output <output>] [--center <file>]\n"
+"  [--focus <file>] [--maximize <file>] [--stretch <file>] [--tile <file>]\n"
+"  [--zoom <file>] [--settle <ms>] [--threads <count>] [--version]\n"
+"       xwallpaper --convert <file> <raw file>\n");
 	exit(1);
 }
 
 #ifdef WITH_RANDR
 static void
-process_event(wp_config_t *config, xcb_connection_t *c,
-    xcb_generic_event_t *event) {
-	xcb_randr_screen_change_notify_event_t *randr_event;
+show_layout(xcb_connection_t *c, xcb_screen_t *screen, wp_config_t *config,
+    xcb_pixmap_t pixmap, xcb_pixmap_t prev)
+{
+	if (config->target & TARGET_ROOT)
+		xcb_change_window_attributes(c, screen->root,
+		    XCB_CW_BACK_PIXMAP, &pixmap);
+	if (config->target & TARGET_ATOMS)
+		process_atoms(c, screen, &pixmap, NULL);
+	else if (prev != XCB_BACK_PIXMAP_NONE && prev != pixmap &&
+	    !is_layout(prev))
+		xcb_free_pixmap(c, prev);
+	xcb_request_check(c, xcb_clear_area(c, 0, screen->root, 0, 0, 0, 0));
+}
+
+/*
+ * Plans screen again and keeps outputs which did not change since the
+ * previous wallpaper, as long as it is still shown.  Known layouts are
+ * shown without drawing anything.
+ */
+static void
+update_screen(wp_config_t *config, xcb_connection_t *c, wp_plan_t *plans,
+    int snum, xcb_screen_t *screen)
+{
 	xcb_screen_iterator_t it;
-	int snum;
+	xcb_pixmap_t current, pixmap, prev;
+	wp_plan_t old;
+
+	old = plans[snum];
+	plans[snum] = (wp_plan_t){ 0 };
+	plan_screen(c, screen, snum, config, &plans[snum]);
+
+	pixmap = find_layout(screen, snum, &plans[snum]);
+	if (pixmap != XCB_BACK_PIXMAP_NONE) {
+		show_layout(c, screen, config, pixmap, old.pixmap);
+		plans[snum].pixmap = pixmap;
+		free_plan(&old);
+		return;
+	}
+
+	/* another program might have replaced the wallpaper */
+	prev = old.pixmap;
+	if (prev != XCB_BACK_PIXMAP_NONE && (config->target & TARGET_ATOMS)) {
+		process_atoms(c, screen, NULL, &current);
+		if (current != prev)
+			prev = XCB_BACK_PIXMAP_NONE;
+	}
+	if (prev != XCB_BACK_PIXMAP_NONE)
+		keep_outputs(&plans[snum], &old);
 
-	randr_event = (xcb_randr_screen_change_notify_event_t *)event;
-	debug("event received: response_type=%u, sequence=%u\n",
-	    randr_event->response_type, randr_event->sequence);
 	it = xcb_setup_roots_iterator(xcb_get_setup(c));
-	for (snum = 0; it.rem; snum++, xcb_screen_next(&it)) {
-		if (it.data->root == randr_event->root) {
-			it.data->width_in_pixels = randr_event->width;
-			it.data->height_in_pixels = randr_event->height;
-			process_screen(c, it.data, snum, config);
-		}
+	plan_buffers(config, plans, it.rem);
+	if (config->cache) {
+		plan_cache(screen, &plans[snum]);
+		plan_buffers(config, plans, it.rem);
 	}
-	if (xcb_connection_has_error(c))
-		warnx("error encountered while setting wallpaper");
+	load_pixman_images(c, it.data, config);
+	if (process_screen(c, screen, config, &plans[snum], prev)) {
+		/* next layout is compared with the one still shown */
+		old.pixmap = plans[snum].pixmap;
+		free_plan(&plans[snum]);
+		plans[snum] = old;
+	} else {
+		free_plan(&old);
+		add_layout(c, screen, snum, config, plans);
+	}
+}
+
+static long
+elapsed(struct timespec *start, clockid_t clock)
+{
+	struct timespec now;
+
+	clock_gettime(clock, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+	    (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/*
+ * Waits until no event arrived for settle milliseconds, so that only
+ * the final layout of a hotplug is drawn.
+ */
+static void
+settle_events(xcb_connection_t *c, wp_config_t *config)
+{
+	struct pollfd pfd;
+
+	pfd.fd = xcb_get_file_descriptor(c);
+	pfd.events = POLLIN;
+	do
+		poll_events(c, NULL);
+	while (!xcb_connection_has_error(c) &&
+	    poll(&pfd, 1, config->settle) > 0);
 }
 
 static void
-process_events(xcb_connection_t *c, wp_config_t *config)
+process_events(xcb_connection_t *c, wp_config_t *config, wp_plan_t *plans)
 {
 	xcb_screen_iterator_t it = xcb_setup_roots_iterator(xcb_get_setup(c));
 	xcb_generic_event_t *event;
-	int snum;
+	struct timespec cpu, start;
+	size_t len;
+	int snum, count;
 
-	for (snum = 0; it.rem; snum++, xcb_screen_next(&it))
+	count = it.rem;
+	SAFE_MUL(len, (size_t)count, sizeof(*changed));
+	changed = xmalloc(len);
+	for (snum = 0; it.rem; snum++, xcb_screen_next(&it)) {
+		changed[snum] = 0;
 		xcb_request_check(c, xcb_randr_select_input(c,
 		    it.data->root,
-		    XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE));
+		    XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE |
+		    XCB_RANDR_NOTIFY_MASK_CRTC_CHANGE |
+		    XCB_RANDR_NOTIFY_MASK_OUTPUT_CHANGE));
+	}
 
-	while ((event = xcb_wait_for_event(c)) != NULL)
-		process_event(config, c, event);
+	while ((event = xcb_wait_for_event(c)) != NULL) {
+		note_event(c, event);
+		free(event);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+		for (;;) {
+			settle_events(c, config);
+			it = xcb_setup_roots_iterator(xcb_get_setup(c));
+			for (snum = 0; it.rem; snum++, xcb_screen_next(&it))
+				if (changed[snum]) {
+					changed[snum] = 0;
+					update_screen(config, c, plans, snum,
+					    it.data);
+				}
+			/* screens might have changed while drawing */
+			for (snum = 0; snum < count && !changed[snum]; snum++)
+				continue;
+			if (snum == count || xcb_connection_has_error(c))
+				break;
+		}
+		if (xcb_connection_has_error(c))
+			warnx("error encountered while setting wallpaper");
+		debug("layout change handled in %ld ms, %ld ms CPU time\n",
+		    elapsed(&start, CLOCK_MONOTONIC),
+		    elapsed(&cpu, CLOCK_PROCESS_CPUTIME_ID));
+	}
 }
 #endif /* WITH_RANDR */
 
@@ -757,14 +1996,20 @@ main(int argc, char *argv[])
 	xcb_connection_t *c2;
 #endif /* WITH_RANDR */
 	xcb_screen_iterator_t it;
-	int snum;
+	wp_plan_t *plans;
+	size_t len;
+	int cache_fd, snum;
 #ifdef HAVE_PLEDGE
-	if (pledge("dns inet proc rpath stdio unix", NULL) == -1)
+	if (pledge(creates_files(argc, argv) ?
+	    "cpath dns fattr inet proc rpath stdio unix wpath" :
+	    "dns inet proc rpath stdio unix", NULL) == -1)
 		err(1, "pledge");
 #endif /* HAVE_PLEDGE */
 #ifdef WITH_SECCOMP
 	stage1_sandbox();
 #endif /* WITH_SECCOMP */
+	if (argc == 4 && strcmp(argv[1], "--convert") == 0)
+		return convert_image(argv[2], argv[3]);
 	if (argc < 2 || (config = parse_config(++argv)) == NULL)
 		usage();
 
@@ -781,12 +2026,18 @@ main(int argc, char *argv[])
 			errx(1, "failed to connect to X server for clean up");
 	}
 #endif /* WITH_RANDR */
+	/* threads have to exist before the sandbox is tightened */
+	init_threads(config->threads);
+	cache_fd = -1;
+	if (config->cache && (cache_fd = init_cache()) == -1)
+		config->cache = 0;
 #ifdef HAVE_PLEDGE
-	if (pledge("stdio", NULL) == -1)
+	if (pledge(config->cache ? PROMISES " rpath wpath cpath fattr" :
+	    PROMISES, NULL) == -1)
 		err(1, "pledge");
 #endif /* HAVE_PLEDGE */
 #ifdef WITH_SECCOMP
-	stage2_sandbox();
+	stage2_sandbox(cache_fd);
 #endif /* WITH_SECCOMP */
 
 	it = xcb_setup_roots_iterator(xcb_get_setup(c));
@@ -799,10 +2050,28 @@ main(int argc, char *argv[])
 	 */
 	if (it.rem == 0)
 		errx(1, "no screen found");
-	load_pixman_images(c, it.data, config->options);
+
+	/* decode images only after knowing how they will be used */
+	SAFE_MUL(len, (size_t)it.rem, sizeof(*plans));
+	plans = xmalloc(len);
+	for (snum = 0; it.rem; snum++, xcb_screen_next(&it)) {
+		plans[snum] = (wp_plan_t){ 0 };
+		plan_screen(c, it.data, snum, config, &plans[snum]);
+	}
+	plan_buffers(config, plans, snum);
+	if (config->cache) {
+		it = xcb_setup_roots_iterator(xcb_get_setup(c));
+		for (snum = 0; it.rem; snum++, xcb_screen_next(&it))
+			plan_cache(it.data, &plans[snum]);
+		plan_buffers(config, plans, snum);
+	}
+
+	it = xcb_setup_roots_iterator(xcb_get_setup(c));
+	load_pixman_images(c, it.data, config);
 
 	for (snum = 0; it.rem; snum++, xcb_screen_next(&it))
-		process_screen(c, it.data, snum, config);
+		process_screen(c, it.data, config, &plans[snum],
+		    XCB_BACK_PIXMAP_NONE);
 
 	if (xcb_connection_has_error(c))
 		warnx("error encountered while setting wallpaper");
@@ -811,8 +2080,12 @@ main(int argc, char *argv[])
 	if (config->daemon) {
 		if (config->daemon && has_randr == 0)
 			warnx("--daemon requires RandR");
-		else
-			process_events(c, config);
+		else {
+			it = xcb_setup_roots_iterator(xcb_get_setup(c));
+			for (snum = 0; it.rem; snum++, xcb_screen_next(&it))
+				add_layout(c, it.data, snum, config, plans);
+			process_events(c, config, plans);
+		}
 	}
 #endif /* WITH_RANDR */
 
@@ -15,9 +15,12 @@
  */
 
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <pixman.h>
 #include <stdio.h>
@@ -28,8 +31,85 @@
 #include "config.h"
 #include "functions.h"
 
+/*
+ * Maps the file of size st_size and starts reading it in background.
+ * Anonymous memory behind the file guarantees that contents are
+ * terminated.  Files which cannot be mapped, e.g. pipes, are read.
+ *
+ * Files which are truncated while mapped raise SIGBUS on access.  Only
+ * regular files of the user are mapped, others are read, because they
+ * could be truncated by someone else.  Files which already changed
+ * their size since st_size was retrieved are read as well, but files
+ * of the user have to be replaced, not truncated, while they are in use.
+ */
+void
+map_buffer(wp_buffer_t *buffer, int fd, const char *filename)
+{
+	struct stat st;
+	uint8_t *p;
+	size_t len, size;
+	ssize_t n;
+
+	if (buffer->st_size > 0 && (uintmax_t)buffer->st_size < SIZE_MAX &&
+	    fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+	    st.st_uid == getuid()) {
+		len = buffer->st_size;
+		p = mmap(NULL, len + 1, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+		    -1, 0);
+		if (p != MAP_FAILED && mmap(p, len, PROT_READ,
+		    MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED &&
+		    fstat(fd, &st) == 0 && st.st_size == buffer->st_size) {
+			madvise(p, len, MADV_SEQUENTIAL);
+			madvise(p, len, MADV_WILLNEED);
+			buffer->data = p;
+			buffer->len = len;
+			buffer->mapped = 1;
+			return;
+		}
+		if (p != MAP_FAILED)
+			munmap(p, len + 1);
+	}
+
+	p = NULL;
+	len = size = 0;
+	for (;;) {
+		if (size - len < 2) {
+			if (size > SIZE_MAX / 2)
+				errx(1, "'%s' is too large", filename);
+			size = size == 0 ? 65536 : size * 2;
+			if ((p = realloc(p, size)) == NULL)
+				err(1, "failed to allocate memory");
+		}
+		n = read(fd, p + len, size - len - 1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "read '%s' failed", filename);
+		}
+		if (n == 0)
+			break;
+		len += n;
+	}
+	p[len] = '\0';
+	buffer->data = p;
+	buffer->len = len;
+	buffer->mapped = 0;
+}
+
+void
+unmap_buffer(wp_buffer_t *buffer)
+{
+	if (buffer->mapped)
+		munmap(buffer->data, buffer->len + 1);
+	else
+		free(buffer->data);
+	buffer->data = NULL;
+	buffer->len = 0;
+}
+
 static size_t
-add_buffer(wp_buffer_t **bufs, size_t *count, wp_buffer_t buf)
+add_buffer(wp_buffer_t **bufs, size_t *count, wp_buffer_t buf, int fd,
+    const char *filename)
 {
 	size_t i;
 
@@ -38,14 +118,14 @@ add_buffer(wp_buffer_t **bufs, size_t *count, wp_buffer_t buf)
 		    (*bufs)[i].st_ino == buf.st_ino)
 			break;
 
-	if (*count != 0 && i != *count)
-		fclose(buf.fp);
-	else {
+	if (*count == 0 || i == *count) {
+		map_buffer(&buf, fd, filename);
 		*bufs = realloc(*bufs, (*count + 1) * sizeof(**bufs));
 		if (*bufs == NULL)
 			err(1, "failed to allocate memory");
 		(*bufs)[(*count)++] = buf;
 	}
+	close(fd);
 
 	return i;
 }
@@ -95,18 +175,22 @@ init_buffers(wp_config_t *config)
 	buffers_count = 0;
 	buffer = (wp_buffer_t){ 0 };
 
+	/* all files are read ahead while the first ones are decoded */
 	for (i = 0; i < config->count; i++) {
 		struct stat st;
+		int fd;
 
-		if ((buffer.fp = fopen(config->options[i].filename, "rb"))
-		    == NULL)
+		if ((fd = open(config->options[i].filename, O_RDONLY)) == -1)
 			err(1, "open '%s' failed", config->options[i].filename);
-		if (fstat(fileno(buffer.fp), &st))
+		if (fstat(fd, &st))
 			err(1, "stat '%s' failed", config->options[i].filename);
 		buffer.st_dev = st.st_dev;
 		buffer.st_ino = st.st_ino;
+		buffer.st_size = st.st_size;
+		buffer.st_mtim = st.st_mtim;
 
-		refs[i] = add_buffer(&buffers, &buffers_count, buffer);
+		refs[i] = add_buffer(&buffers, &buffers_count, buffer, fd,
+		    config->options[i].filename);
 	}
 
 	for (i = 0; i < config->count; i++)
@@ -133,14 +217,14 @@ parse_mode(char *mode)
 }
 
 static int
-parse_int(char *string)
+parse_int(char *string, const char *what)
 {
 	char *endptr;
 	long value;
 
 	value = strtol(string, &endptr, 10);
 	if (endptr == string || *endptr != '\0' || value < 0 || value > INT_MAX)
-		errx(1, "failed to parse screen number: %s", string);
+		errx(1, "failed to parse %s: %s", what, string);
 	return value;
 }
 
@@ -185,13 +269,20 @@ parse_config(char **argv)
 		.count = 0,
 		.daemon = 0,
 		.source = SOURCE_ATOMS,
-		.target = TARGET_ATOMS | TARGET_ROOT
+		.target = TARGET_ATOMS | TARGET_ROOT,
+		.threads = 0,
+		.cache = 0,
+		.settle = SETTLE_DELAY,
+		.layouts = LAYOUT_COUNT,
+		.layout_memory = (size_t)LAYOUT_MEMORY << 20
 	};
 
 	last = (wp_option_t){ .screen = -1 };
 
 	while (*argv != NULL) {
-		if (strcmp(argv[0], "--daemon") == 0) {
+		if (strcmp(argv[0], "--cache") == 0)
+			config->cache = 1;
+		else if (strcmp(argv[0], "--daemon") == 0) {
 			config->daemon = 1;
 		} else if (strcmp(argv[0], "--debug") == 0)
 			show_debug = 1;
@@ -218,7 +309,7 @@ parse_config(char **argv)
 			last.filename = NULL;
 			last.mode = 0;
 			last.output = NULL;
-			last.screen = parse_int(*argv);
+			last.screen = parse_int(*argv, "screen number");
 			last.trim = NULL;
 		} else if (strcmp(argv[0], "--output") == 0) {
 			if (*++argv == NULL) {
@@ -246,6 +337,36 @@ parse_config(char **argv)
 				return NULL;
 			}
 			has_randr = 0;
+		} else if (strcmp(argv[0], "--layouts") == 0) {
+			if (*++argv == NULL) {
+				warnx("missing argument for --layouts");
+				return NULL;
+			}
+			config->layouts = parse_int(*argv, "layout count");
+		} else if (strcmp(argv[0], "--layout-memory") == 0) {
+			if (*++argv == NULL) {
+				warnx("missing argument for --layout-memory");
+				return NULL;
+			}
+			SAFE_MUL(config->layout_memory,
+			    (size_t)parse_int(*argv, "layout memory"),
+			    (size_t)1 << 20);
+		} else if (strcmp(argv[0], "--settle") == 0) {
+			if (*++argv == NULL) {
+				warnx("missing argument for --settle");
+				return NULL;
+			}
+			config->settle = parse_int(*argv, "settle delay");
+		} else if (strcmp(argv[0], "--threads") == 0) {
+			if (*++argv == NULL) {
+				warnx("missing argument for --threads");
+				return NULL;
+			}
+			config->threads = parse_int(*argv, "thread count");
+			if (config->threads == 0) {
+				warnx("--threads requires at least 1 thread");
+				return NULL;
+			}
 		} else if (strcmp(argv[0], "--trim") == 0) {
 			if (*++argv == NULL) {
 				warnx("missing argument for --trim");
@@ -38,9 +38,15 @@ void
 free_outputs(wp_output_t *outputs)
 {
 	wp_output_t *output;
+	char **alias;
 
-	for (output = outputs; output->name != NULL; output++)
+	for (output = outputs; output->name != NULL; output++) {
+		for (alias = output->aliases; alias != NULL && *alias != NULL;
+		    alias++)
+			free(*alias);
+		free(output->aliases);
 		free(output->name);
+	}
 	free(outputs);
 }
 
@@ -48,10 +54,16 @@ wp_output_t *
 get_output(wp_output_t *outputs, char *name)
 {
 	wp_output_t *output;
+	char **alias;
 
-	for (output = outputs; output->name != NULL; output++)
-		if (name != NULL && strcmp(output->name, name) == 0)
+	for (output = outputs; name != NULL && output->name != NULL; output++) {
+		if (strcmp(output->name, name) == 0)
 			return output;
+		for (alias = output->aliases; alias != NULL && *alias != NULL;
+		    alias++)
+			if (strcmp(*alias, name) == 0)
+				return output;
+	}
 
 	if (name != NULL) {
 		warnx("output %s was not found/disconnected, ignoring", name);
@@ -62,14 +74,189 @@ get_output(wp_output_t *outputs, char *name)
 }
 
 #ifdef WITH_RANDR
+#ifdef HAVE_RANDR_MONITORS
+/* server supports RandR 1.5 monitors */
+static int has_monitors = 0;
+#endif /* HAVE_RANDR_MONITORS */
+
 static int
 check_randr(xcb_connection_t *c)
 {
 	const xcb_query_extension_reply_t *reply;
+#ifdef HAVE_RANDR_MONITORS
+	xcb_randr_query_version_cookie_t version_cookie;
+	xcb_randr_query_version_reply_t *version_reply;
+#endif /* HAVE_RANDR_MONITORS */
 
 	reply = xcb_get_extension_data(c, &xcb_randr_id);
-	return reply != NULL && reply->present;
+	if (reply == NULL || !reply->present)
+		return 0;
+
+#ifdef HAVE_RANDR_MONITORS
+	version_cookie = xcb_randr_query_version(c, 1, 5);
+	version_reply = xcb_randr_query_version_reply(c, version_cookie, NULL);
+	if (version_reply != NULL) {
+		debug("randr version: %u.%u\n", version_reply->major_version,
+		    version_reply->minor_version);
+		has_monitors = version_reply->major_version > 1 ||
+		    version_reply->minor_version >= 5;
+		free(version_reply);
+	}
+#endif /* HAVE_RANDR_MONITORS */
+	return 1;
+}
+
+static char *
+copy_name(const void *name, int len)
+{
+	char *s;
+
+	s = xmalloc((size_t)len + 1);
+	memcpy(s, name, len);
+	s[len] = '\0';
+	return s;
+}
+
+/*
+ * Adds name of another output showing the same area, so it can still
+ * be selected with --output.
+ */
+static void
+add_alias(wp_output_t *output, const void *name, int len)
+{
+	char *alias;
+	size_t n, size;
+
+	alias = copy_name(name, len);
+	if (strcmp(alias, output->name) == 0) {
+		free(alias);
+		return;
+	}
+
+	for (n = 0; output->aliases != NULL && output->aliases[n] != NULL; n++)
+		;
+	SAFE_MUL(size, n + 2, sizeof(*output->aliases));
+	output->aliases = realloc(output->aliases, size);
+	if (output->aliases == NULL)
+		err(1, "failed to allocate memory");
+	output->aliases[n] = alias;
+	output->aliases[n + 1] = NULL;
+}
+
+static void
+debug_output(wp_output_t *output)
+{
+	char **alias;
+
+	debug("output detected: %s, %dx%d+%d+%d\n", output->name,
+	    output->width, output->height, output->x, output->y);
+	for (alias = output->aliases; alias != NULL && *alias != NULL; alias++)
+		debug("output %s is part of %s\n", *alias, output->name);
+}
+
+#ifdef HAVE_RANDR_MONITORS
+/*
+ * Retrieves active monitors, which combine tiled outputs and clones into
+ * one logical output each.  Returns NULL if no monitor is available.
+ */
+static wp_output_t *
+get_monitor_outputs(xcb_connection_t *c, xcb_screen_t *screen)
+{
+	wp_output_t *outputs;
+	xcb_randr_get_monitors_cookie_t monitors_cookie;
+	xcb_randr_get_monitors_reply_t *monitors_reply;
+	xcb_randr_monitor_info_iterator_t it;
+	xcb_get_atom_name_cookie_t *name_cookies;
+	xcb_get_atom_name_reply_t *name_reply;
+	xcb_randr_get_output_info_cookie_t *output_cookies;
+	xcb_randr_get_output_info_reply_t *output_reply;
+	xcb_randr_output_t *xcb_outputs;
+	size_t i, j, k, n, len, total;
+
+	monitors_cookie = xcb_randr_get_monitors(c, screen->root, 1);
+	monitors_reply = xcb_randr_get_monitors_reply(c, monitors_cookie,
+	    NULL);
+	if (monitors_reply == NULL)
+		return NULL;
+	len = xcb_randr_get_monitors_monitors_length(monitors_reply);
+	if (len == 0) {
+		free(monitors_reply);
+		return NULL;
+	}
+
+	total = 0;
+	it = xcb_randr_get_monitors_monitors_iterator(monitors_reply);
+	for (i = 0; i < len; i++, xcb_randr_monitor_info_next(&it))
+		total += xcb_randr_monitor_info_outputs_length(it.data);
+	if (total == 0) {
+		free(monitors_reply);
+		return NULL;
+	}
+
+	/* issue all requests before waiting for any reply */
+	SAFE_MUL(n, len, sizeof(*name_cookies));
+	name_cookies = xmalloc(n);
+	SAFE_MUL(n, total, sizeof(*output_cookies));
+	output_cookies = xmalloc(n);
+	it = xcb_randr_get_monitors_monitors_iterator(monitors_reply);
+	for (i = 0, k = 0; i < len; i++, xcb_randr_monitor_info_next(&it)) {
+		name_cookies[i] = xcb_get_atom_name(c, it.data->name);
+		xcb_outputs = xcb_randr_monitor_info_outputs(it.data);
+		n = xcb_randr_monitor_info_outputs_length(it.data);
+		for (j = 0; j < n; j++)
+			output_cookies[k++] = xcb_randr_get_output_info(c,
+			    xcb_outputs[j], XCB_CURRENT_TIME);
+	}
+
+	SAFE_MUL(n, len + 1, sizeof(*outputs));
+	outputs = xmalloc(n);
+	it = xcb_randr_get_monitors_monitors_iterator(monitors_reply);
+	for (i = 0, k = 0; i < len; i++, xcb_randr_monitor_info_next(&it)) {
+		name_reply = xcb_get_atom_name_reply(c, name_cookies[i], NULL);
+		if (name_reply == NULL)
+			errx(1, "failed to retrieve randr monitor name");
+		outputs[i] = (wp_output_t){
+			.name = copy_name(xcb_get_atom_name_name(name_reply),
+			    xcb_get_atom_name_name_length(name_reply)),
+			.aliases = NULL,
+			.x = it.data->x,
+			.y = it.data->y,
+			.width = it.data->width,
+			.height = it.data->height
+		};
+		free(name_reply);
+
+		n = xcb_randr_monitor_info_outputs_length(it.data);
+		for (j = 0; j < n; j++, k++) {
+			output_reply = xcb_randr_get_output_info_reply(c,
+			    output_cookies[k], NULL);
+			if (output_reply == NULL)
+				continue;
+			add_alias(&outputs[i],
+			    xcb_randr_get_output_info_name(output_reply),
+			    xcb_randr_get_output_info_name_length(
+			    output_reply));
+			free(output_reply);
+		}
+		debug_output(&outputs[i]);
+	}
+	free(output_cookies);
+	free(name_cookies);
+	free(monitors_reply);
+
+	outputs[len] = (wp_output_t){
+		.name = NULL,
+		.x = 0,
+		.y = 0,
+		.width = screen->width_in_pixels,
+		.height = screen->height_in_pixels
+	};
+	debug("(randr monitors) screen dimensions: %dx%d+%d+%d\n",
+	    outputs[len].width, outputs[len].height, outputs[len].x,
+	    outputs[len].y);
+	return outputs;
 }
+#endif /* HAVE_RANDR_MONITORS */
 
 static wp_output_t *
 get_randr_outputs(xcb_connection_t *c, xcb_screen_t *screen)
@@ -77,73 +264,124 @@ get_randr_outputs(xcb_connection_t *c, xcb_screen_t *screen)
 	wp_output_t *outputs;
 	xcb_randr_get_screen_resources_cookie_t resources_cookie;
 	xcb_randr_get_screen_resources_reply_t *resources_reply;
+	xcb_randr_get_output_info_cookie_t *output_cookies;
+	xcb_randr_get_output_info_reply_t **output_replies;
+	xcb_randr_get_crtc_info_cookie_t *crtc_cookies;
+	xcb_randr_get_crtc_info_reply_t *crtc_reply;
 	xcb_randr_output_t *xcb_outputs;
-	int i, j, len;
-	size_t n;
+	xcb_randr_crtc_t *crtcs;
+	int i, len;
+	size_t j, k, n, ncrtcs;
 
 	resources_cookie = xcb_randr_get_screen_resources(c, screen->root);
 	resources_reply = xcb_randr_get_screen_resources_reply(c,
 	    resources_cookie, NULL);
+	if (resources_reply == NULL)
+		errx(1, "failed to retrieve randr outputs");
 
 	xcb_outputs = xcb_randr_get_screen_resources_outputs(resources_reply);
 	len = xcb_randr_get_screen_resources_outputs_length(resources_reply);
 	if (len < 1)
 		errx(1, "failed to retrieve randr outputs");
 
-	SAFE_MUL(n, (size_t)len + 1, sizeof(*outputs));
-	outputs = xmalloc(n);
+	/* issue all requests before waiting for any reply */
+	SAFE_MUL(n, (size_t)len, sizeof(*output_cookies));
+	output_cookies = xmalloc(n);
+	for (i = 0; i < len; i++)
+		output_cookies[i] = xcb_randr_get_output_info(c,
+		    xcb_outputs[i], XCB_CURRENT_TIME);
 
-	j = 0;
+	/* cloned outputs share a CRTC, which is queried only once */
+	SAFE_MUL(n, (size_t)len, sizeof(*output_replies));
+	output_replies = xmalloc(n);
+	SAFE_MUL(n, (size_t)len, sizeof(*crtcs));
+	crtcs = xmalloc(n);
+	ncrtcs = 0;
 	for (i = 0; i < len; i++) {
-		xcb_randr_get_output_info_cookie_t output_cookie;
-		xcb_randr_get_output_info_reply_t *output_reply;
-		xcb_randr_get_crtc_info_cookie_t crtc_cookie;
-		xcb_randr_get_crtc_info_reply_t *crtc_reply;
-		int name_len;
-		uint8_t *name;
-
-		output_cookie = xcb_randr_get_output_info(c, xcb_outputs[i],
-		    XCB_CURRENT_TIME);
-		output_reply = xcb_randr_get_output_info_reply(c, output_cookie,
-		    NULL);
-
-		if (output_reply->connection != XCB_RANDR_CONNECTION_CONNECTED ||
-		    output_reply->crtc == XCB_NONE)
+		output_replies[i] = xcb_randr_get_output_info_reply(c,
+		    output_cookies[i], NULL);
+		if (output_replies[i] == NULL)
 			continue;
+		if (output_replies[i]->connection !=
+		    XCB_RANDR_CONNECTION_CONNECTED ||
+		    output_replies[i]->crtc == XCB_NONE) {
+			free(output_replies[i]);
+			output_replies[i] = NULL;
+			continue;
+		}
+		for (j = 0; j < ncrtcs; j++)
+			if (crtcs[j] == output_replies[i]->crtc)
+				break;
+		if (j == ncrtcs)
+			crtcs[ncrtcs++] = output_replies[i]->crtc;
+	}
+	free(output_cookies);
 
-		crtc_cookie = xcb_randr_get_crtc_info(c, output_reply->crtc,
+	/* no output is active, e.g. while undocking */
+	SAFE_MUL(n, ncrtcs, sizeof(*crtc_cookies));
+	crtc_cookies = ncrtcs > 0 ? xmalloc(n) : NULL;
+	for (j = 0; j < ncrtcs; j++)
+		crtc_cookies[j] = xcb_randr_get_crtc_info(c, crtcs[j],
 		    XCB_CURRENT_TIME);
-		crtc_reply = xcb_randr_get_crtc_info_reply(c, crtc_cookie,
-		    NULL);
 
-		name = xcb_randr_get_output_info_name(output_reply);
-		name_len = xcb_randr_get_output_info_name_length(output_reply);
+	SAFE_MUL(n, ncrtcs + 1, sizeof(*outputs));
+	outputs = xmalloc(n);
+
+	k = 0;
+	for (j = 0; j < ncrtcs; j++) {
+		crtc_reply = xcb_randr_get_crtc_info_reply(c, crtc_cookies[j],
+		    NULL);
+		if (crtc_reply == NULL)
+			continue;
 
-		outputs[j] = (wp_output_t){
+		outputs[k] = (wp_output_t){
+			.name = NULL,
+			.aliases = NULL,
 			.x = crtc_reply->x,
 			.y = crtc_reply->y,
 			.width = crtc_reply->width,
 			.height = crtc_reply->height
 		};
-		outputs[j].name = xmalloc((size_t)name_len + 1);
-		memcpy(outputs[j].name, name, name_len);
-		outputs[j].name[name_len] = '\0';
-
-		debug("output detected: %s, %dx%d+%d+%d\n", outputs[j].name,
-		    outputs[j].width, outputs[j].height, outputs[j].x,
-		    outputs[j].y);
-		j++;
+		free(crtc_reply);
+
+		/* first output names the CRTC, clones become aliases */
+		for (i = 0; i < len; i++) {
+			if (output_replies[i] == NULL ||
+			    output_replies[i]->crtc != crtcs[j])
+				continue;
+			if (outputs[k].name == NULL)
+				outputs[k].name = copy_name(
+				    xcb_randr_get_output_info_name(
+				    output_replies[i]),
+				    xcb_randr_get_output_info_name_length(
+				    output_replies[i]));
+			else
+				add_alias(&outputs[k],
+				    xcb_randr_get_output_info_name(
+				    output_replies[i]),
+				    xcb_randr_get_output_info_name_length(
+				    output_replies[i]));
+		}
+		debug_output(&outputs[k]);
+		k++;
 	}
 
-	outputs[j] = (wp_output_t){
+	for (i = 0; i < len; i++)
+		free(output_replies[i]);
+	free(output_replies);
+	free(crtc_cookies);
+	free(crtcs);
+	free(resources_reply);
+
+	outputs[k] = (wp_output_t){
 		.name = NULL,
 		.x = 0,
 		.y = 0,
 		.width = screen->width_in_pixels,
 		.height = screen->height_in_pixels
 	};
-	debug("(randr) screen dimensions: %dx%d+%d+%d\n", outputs[j].width,
-	    outputs[j].height, outputs[j].x, outputs[j].y);
+	debug("(randr) screen dimensions: %dx%d+%d+%d\n", outputs[k].width,
+	    outputs[k].height, outputs[k].x, outputs[k].y);
 	return outputs;
 }
 #endif /* WITH_RANDR */
@@ -155,8 +393,14 @@ get_outputs(xcb_connection_t *c, xcb_screen_t *screen)
 #ifdef WITH_RANDR
 	if (has_randr == -1)
 		has_randr = check_randr(c);
-	if (has_randr)
+	if (has_randr) {
+#ifdef HAVE_RANDR_MONITORS
+		if (has_monitors &&
+		    (outputs = get_monitor_outputs(c, screen)) != NULL)
+			return outputs;
+#endif /* HAVE_RANDR_MONITORS */
 		return get_randr_outputs(c, screen);
+	}
 #endif /* WITH_RANDR */
 	outputs = xmalloc(sizeof(*outputs));
 
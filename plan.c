@@ -0,0 +1,646 @@
+/*
+ * Copyright (c) 2025 Tobias Stoeckmann <tobias@stoeckmann.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <xcb/xcb.h>
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "functions.h"
+
+#define MAXIMUM(x, y) ((x) > (y) ? (x) : (y))
+#define MINIMUM(x, y) ((x) < (y) ? (x) : (y))
+
+/* pixels around visible area which are accessed by bilinear filters */
+#define FILTER_MARGIN	2
+
+static void
+add_job(wp_plan_t *plan, wp_option_t *option, wp_output_t *output)
+{
+	size_t len;
+
+	SAFE_MUL(len, plan->count + 1, sizeof(*plan->jobs));
+	plan->jobs = realloc(plan->jobs, len);
+	if (plan->jobs == NULL)
+		err(1, "failed to allocate memory");
+	plan->jobs[plan->count++] = (wp_job_t){
+		.option = option,
+		.output = output,
+		.cache = NULL
+	};
+}
+
+static void
+add_target(wp_buffer_t *buffer, wp_target_t target)
+{
+	size_t len;
+
+	SAFE_MUL(len, buffer->count + 1, sizeof(*buffer->targets));
+	buffer->targets = realloc(buffer->targets, len);
+	if (buffer->targets == NULL)
+		err(1, "failed to allocate memory");
+	buffer->targets[buffer->count++] = target;
+}
+
+void
+free_plan(wp_plan_t *plan)
+{
+	size_t i;
+
+	for (i = 0; i < plan->count; i++)
+		close_cache(plan->jobs[i].cache);
+	if (plan->outputs != NULL)
+		free_outputs(plan->outputs);
+	free(plan->jobs);
+	*plan = (wp_plan_t){ 0 };
+}
+
+/*
+ * Find the largest power of two up to denom which still keeps at least
+ * one pixel for every output pixel of all targets. Modes which show the
+ * image unscaled, i.e. center and tile, always require full resolution.
+ */
+static unsigned int
+find_denom(wp_buffer_t *buffer, unsigned int denom)
+{
+	size_t i;
+
+	for (i = 0; i < buffer->count && denom > 1; i++) {
+		wp_target_t *target;
+		float w_scale, h_scale, scale;
+
+		target = &buffer->targets[i];
+		if (target->trim == NULL) {
+			w_scale = (float)buffer->info.width / target->width;
+			h_scale = (float)buffer->info.height / target->height;
+		} else {
+			w_scale = (float)target->trim->width / target->width;
+			h_scale = (float)target->trim->height / target->height;
+		}
+
+		switch (target->mode) {
+		case MODE_FOCUS:
+			/* focus box is never smaller than trim box */
+		case MODE_MAXIMIZE:
+			scale = w_scale < h_scale ? h_scale : w_scale;
+			break;
+		case MODE_STRETCH:
+		case MODE_ZOOM:
+			scale = w_scale > h_scale ? h_scale : w_scale;
+			break;
+		default:
+			scale = 1;
+			break;
+		}
+
+		while (denom > 1 && scale < denom)
+			denom /= 2;
+	}
+
+	return denom;
+}
+
+/*
+ * Scaling denominator for decoding.  JPEG is scaled with DCT, PNG rows
+ * are averaged while decoding.  Rows of interlaced PNG only become
+ * available after the last pass.
+ */
+unsigned int
+get_scale_denom(wp_buffer_t *buffer)
+{
+	if (buffer->count == 0)
+		return 1;
+	if (buffer->info.format != FORMAT_JPEG &&
+	    (buffer->info.format != FORMAT_PNG || buffer->info.interlaced))
+		return 1;
+	return find_denom(buffer, 8);
+}
+
+/*
+ * Scaling denominator after halving decoded images, which leaves less
+ * than a factor of 2 to the filter of transformations.
+ */
+unsigned int
+get_reduce_denom(wp_buffer_t *buffer)
+{
+	if (buffer->count == 0)
+		return 1;
+	return find_denom(buffer, MAX_DENOM);
+}
+
+/*
+ * Calculates the transformation of output coordinates into coordinates
+ * of the original image for a target.  The calculation is only shown
+ * if verbose is set, because it is repeated while planning.
+ */
+void
+get_transform(wp_target_t *target, wp_info_t *info,
+    pixman_f_transform_t *ftransform, int verbose)
+{
+	int mode;
+	uint16_t pix_width, pix_height;
+	uint16_t src_width, src_height;
+	uint16_t xcb_width, xcb_height;
+	float w_scale, h_scale, scale;
+	float translate_x, translate_y;
+	float off_x, off_y;
+
+	mode = target->mode;
+	pix_width = info->width;
+	pix_height = info->height;
+	xcb_width = target->width;
+	xcb_height = target->height;
+
+	if (target->trim == NULL) {
+		src_width = pix_width;
+		src_height = pix_height;
+		off_x = 0;
+		off_y = 0;
+	} else {
+		src_width = target->trim->width;
+		src_height = target->trim->height;
+		off_x = (float)target->trim->x_off;
+		off_y = (float)target->trim->y_off;
+	}
+
+	if (mode == MODE_FOCUS) {
+		float target_x, target_y;
+		uint16_t target_width, target_height;
+		float ratio;
+
+		if (verbose)
+			debug("focus on trim box %hux%hu%+.0f%+.0f of %hux%hu "
+			    "for output %hux%hu\n", src_width, src_height,
+			    off_x, off_y, pix_width, pix_height, xcb_width,
+			    xcb_height);
+
+		ratio = (float)xcb_width / xcb_height;
+		if (verbose)
+			debug("output ratio is %f\n", ratio);
+
+		/*
+		 * Calculate minimum box to use.
+		 *
+		 * The minimum box depends solely on the input image dimensions
+		 * and will be used if the specified trim box fully fits in it.
+		 *
+		 * This guarantees that we never zoom in further than needed
+		 * even on very small trim boxes.
+		 */
+		if (pix_width > xcb_width && pix_height > xcb_height) {
+			/*
+			 * If the input image is larger than output, then use
+			 * output dimensions. No zooming in occurs and leads
+			 * to best quality.
+			 */
+			target_width = xcb_width;
+			target_height = xcb_height;
+		} else {
+			/*
+			 * At least one dimension of input image is smaller than
+			 * the corresponding output dimension. Zooming in is
+			 * required to prevent black borders.
+			 */
+			float rx, ry;
+
+			rx = (float)xcb_width / pix_width;
+			ry = (float)xcb_height / pix_height;
+			if (verbose)
+				debug("minimum box check: rx = %f, ry = %f\n",
+				    rx, ry);
+
+			/* Zoom in and keep aspect ratio of output. */
+			if (rx < ry) {
+				target_width = MAXIMUM(1, pix_height * ratio);
+				target_height = pix_height;
+			} else {
+				target_width = pix_width;
+				target_height = MAXIMUM(1, pix_width / ratio);
+			}
+		}
+		if (verbose)
+			debug("minimum box dimensions are %hux%hu\n",
+			    target_width, target_height);
+
+		/*
+		 * If trim box fits into minimum box, then use minimum box.
+		 * Otherwise it means that box must be zoomed out to cover the
+		 * whole trim box. Black borders can occur due to this.
+		 */
+		if (src_width > target_width || src_height > target_height) {
+			float rx, ry;
+
+			rx = (float)src_width / target_width;
+			ry = (float)src_height / target_height;
+			if (verbose)
+				debug("target box check: rx = %f, ry = %f\n",
+				    rx, ry);
+
+			/* Zoom out and keep aspect ratio of output. */
+			if (rx < ry) {
+				target_width = MAXIMUM(1, src_height * ratio);
+				target_height = src_height;
+			} else {
+				target_width = src_width;
+				target_height = MAXIMUM(1, src_width / ratio);
+			}
+		}
+		if (verbose)
+			debug("target box dimensions are %hux%hu\n",
+			    target_width, target_height);
+
+		/*
+		 * Find proper offsets.
+		 *
+		 * If the image file lacks enough pixels around current box,
+		 * then black borders on output are unfortunate but inevitable.
+		 * It is much more important to keep the constraint of having
+		 * all pixels within the trim box on output.
+		 */
+		target_x = MAXIMUM(0, off_x - (target_width - src_width) / 2);
+		target_y = MAXIMUM(0, off_y - (target_height - src_height) / 2);
+
+		if (target_width > pix_width - target_x) {
+			if (target_width > pix_width)
+				target_x = (pix_width - target_width) / 2;
+			else
+				target_x = pix_width - target_width;
+		}
+		if (target_height > pix_height - target_y) {
+			if (target_height > pix_height)
+				target_y = (pix_height - target_height) / 2;
+			else
+				target_y = pix_height - target_height;
+		}
+
+		mode = MODE_MAXIMIZE;
+		off_x = target_x;
+		off_y = target_y;
+		src_width = target_width;
+		src_height = target_height;
+
+		if (verbose)
+			debug("final source box is %hux%hu%+.0f%+.0f\n",
+			    src_width, src_height, off_x, off_y);
+	}
+
+	w_scale = (float)src_width / xcb_width;
+	h_scale = (float)src_height / xcb_height;
+
+	switch (mode) {
+	case MODE_CENTER:
+		w_scale = 1;
+		h_scale = 1;
+		break;
+	case MODE_MAXIMIZE:
+		scale = w_scale < h_scale ? h_scale : w_scale;
+		w_scale = scale;
+		h_scale = scale;
+		break;
+	case MODE_ZOOM:
+		scale = w_scale > h_scale ? h_scale : w_scale;
+		w_scale = scale;
+		h_scale = scale;
+	default:
+		break;
+	}
+
+	translate_x = (src_width / w_scale - xcb_width) / 2 + off_x / w_scale;
+	translate_y = (src_height / h_scale - xcb_height) / 2 + off_y / h_scale;
+
+	pixman_f_transform_init_translate(ftransform,
+	    translate_x, translate_y);
+	if (target->mode != MODE_CENTER)
+		pixman_f_transform_scale(ftransform, NULL, w_scale, h_scale);
+}
+
+/*
+ * Calculates the part of an image which is accessed by any target, in
+ * coordinates of the image as decoded with given scaling denominator.
+ * Files which cannot be decoded partially are always fully covered.
+ */
+void
+get_region(wp_buffer_t *buffer, unsigned int denom, wp_box_t *region)
+{
+	pixman_f_transform_t ftransform;
+	pixman_f_vector_t v;
+	wp_info_t *info;
+	wp_target_t *target;
+	double radius, x1, y1, x2, y2;
+	uint32_t width, height, left, top, right, bottom, margin, reduce;
+	size_t i;
+	int n;
+
+	info = &buffer->info;
+	width = (info->width + denom - 1) / denom;
+	height = (info->height + denom - 1) / denom;
+
+	/* XPM and interlaced PNG cannot be cropped, raw needs no decoding */
+	if (buffer->count == 0 || info->format == FORMAT_XPM ||
+	    info->format == FORMAT_RAW ||
+	    (info->format == FORMAT_PNG && info->interlaced)) {
+		*region = (wp_box_t){
+			.x_off = 0,
+			.y_off = 0,
+			.width = width,
+			.height = height
+		};
+		return;
+	}
+
+	/* margin in pixels of image after halving, see load_pixman_images */
+	reduce = get_reduce_denom(buffer);
+	margin = FILTER_MARGIN;
+	x1 = info->width;
+	y1 = info->height;
+	x2 = 0;
+	y2 = 0;
+	for (i = 0; i < buffer->count; i++) {
+		target = &buffer->targets[i];
+
+		/* tiles are copied without transformation */
+		if (target->mode == MODE_TILE) {
+			if (target->trim == NULL) {
+				x1 = y1 = 0;
+				x2 = info->width;
+				y2 = info->height;
+			} else {
+				x1 = MINIMUM(x1, target->trim->x_off);
+				y1 = MINIMUM(y1, target->trim->y_off);
+				x2 = MAXIMUM(x2, target->trim->x_off +
+				    target->trim->width);
+				y2 = MAXIMUM(y2, target->trim->y_off +
+				    target->trim->height);
+			}
+			continue;
+		}
+
+		/* corners suffice because transformation is affine */
+		get_transform(target, info, &ftransform, 0);
+		/* Lanczos filters of reductions grow with their factor */
+		radius = LANCZOS_RADIUS * MAXIMUM(ftransform.m[0][0],
+		    ftransform.m[1][1]) / reduce;
+		if (radius > margin)
+			margin = (uint32_t)radius + (radius > (uint32_t)radius);
+		for (n = 0; n < 4; n++) {
+			v.v[0] = n & 1 ? target->width : 0;
+			v.v[1] = n & 2 ? target->height : 0;
+			v.v[2] = 1;
+			pixman_f_transform_point_3d(&ftransform, &v);
+			x1 = MINIMUM(x1, v.v[0]);
+			y1 = MINIMUM(y1, v.v[1]);
+			x2 = MAXIMUM(x2, v.v[0]);
+			y2 = MAXIMUM(y2, v.v[1]);
+		}
+	}
+
+	/* convert into decoded pixels, rounding outwards */
+	x1 = MINIMUM(width, MAXIMUM(0, x1 / denom));
+	y1 = MINIMUM(height, MAXIMUM(0, y1 / denom));
+	x2 = MINIMUM(width, MAXIMUM(0, x2 / denom));
+	y2 = MINIMUM(height, MAXIMUM(0, y2 / denom));
+	left = (uint32_t)x1;
+	top = (uint32_t)y1;
+	right = (uint32_t)x2 + (x2 > (uint32_t)x2);
+	bottom = (uint32_t)y2 + (y2 > (uint32_t)y2);
+
+	if (reduce > denom)
+		margin *= reduce / denom;
+	left = left > margin ? left - margin : 0;
+	top = top > margin ? top - margin : 0;
+	right = MINIMUM(width, right + margin);
+	bottom = MINIMUM(height, bottom + margin);
+
+	/* keep at least one pixel even if nothing is visible */
+	if (left >= right) {
+		left = MINIMUM(left, width - 1);
+		right = left + 1;
+	}
+	if (top >= bottom) {
+		top = MINIMUM(top, height - 1);
+		bottom = top + 1;
+	}
+
+	*region = (wp_box_t){
+		.x_off = left,
+		.y_off = top,
+		.width = right - left,
+		.height = bottom - top
+	};
+}
+
+/*
+ * Collects outputs of a screen and lists which option has to be rendered
+ * on which output. Jobs are kept in order of command line arguments,
+ * because later ones overwrite previous ones.
+ */
+void
+plan_screen(xcb_connection_t *c, xcb_screen_t *screen, int snum,
+    wp_config_t *config, wp_plan_t *plan)
+{
+	wp_option_t *opt, *options;
+	wp_output_t *output;
+
+	free_plan(plan);
+	options = config->options;
+
+	/*
+	 * Let X perform non-randr tiling if requested. The output is faked
+	 * as soon as picture dimensions are known.
+	 */
+	if (options != NULL && options[0].mode == MODE_TILE &&
+	    options[0].output == NULL && options[1].filename == NULL) {
+		if (options[0].screen == -1 || options[0].screen == snum)
+			add_job(plan, options, NULL);
+		return;
+	}
+
+	plan->outputs = get_outputs(c, screen);
+
+	for (opt = options; opt != NULL && opt->filename != NULL; opt++) {
+		/* ignore options which are not relevant for this screen */
+		if (opt->screen != -1 && opt->screen != snum)
+			continue;
+
+		if (opt->output != NULL &&
+		    strcmp(opt->output, "all") == 0)
+			for (output = plan->outputs; output->name != NULL;
+			    output++)
+				add_job(plan, opt, output);
+		else {
+			output = get_output(plan->outputs, opt->output);
+			if (output != NULL)
+				add_job(plan, opt, output);
+		}
+	}
+}
+
+static int
+overlaps(wp_plan_t *plan)
+{
+	wp_output_t *a, *b;
+	size_t i, j;
+
+	for (i = 0; i < plan->count; i++) {
+		a = plan->jobs[i].output;
+		/* whole screen */
+		if (a == NULL || a->name == NULL)
+			return 1;
+		for (j = 0; j < plan->count; j++) {
+			b = plan->jobs[j].output;
+			if (a != b && b != NULL &&
+			    a->x < b->x + b->width && b->x < a->x + a->width &&
+			    a->y < b->y + b->height && b->y < a->y + a->height)
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Marks outputs whose wallpaper is still found in the previous one,
+ * i.e. outputs of old plan with same name and size.  Drawing order
+ * matters for overlapping outputs, so nothing is kept for them.
+ */
+void
+keep_outputs(wp_plan_t *plan, wp_plan_t *old)
+{
+	wp_output_t *output, *prev;
+
+	if (plan->outputs == NULL || old->outputs == NULL ||
+	    overlaps(plan) || overlaps(old))
+		return;
+
+	for (output = plan->outputs; output->name != NULL; output++) {
+		for (prev = old->outputs; prev->name != NULL; prev++)
+			if (strcmp(prev->name, output->name) == 0)
+				break;
+		if (prev->name == NULL || prev->width != output->width ||
+		    prev->height != output->height)
+			continue;
+		output->keep = 1;
+		output->old_x = prev->x;
+		output->old_y = prev->y;
+		debug("keeping wallpaper of output %s\n", output->name);
+	}
+}
+
+/*
+ * Returns format in which outputs of screen are composed.
+ */
+pixman_format_code_t
+get_format(xcb_screen_t *screen)
+{
+	switch (screen->root_depth) {
+	case 16:
+		return PIXMAN_r5g6b5;
+	case 30:
+		return PIXMAN_x2r10g10b10;
+	default:
+		return PIXMAN_x8r8g8b8;
+	}
+}
+
+/*
+ * Returns 1 if all outputs which show pixels of buffer are found in
+ * the cache.
+ */
+static int
+is_cached(wp_buffer_t *buffer, wp_plan_t *plans, size_t count)
+{
+	size_t i, j;
+
+	for (i = 0; i < count; i++)
+		for (j = 0; j < plans[i].count; j++) {
+			wp_job_t *job = &plans[i].jobs[j];
+
+			if (job->option->buffer != buffer ||
+			    (job->output != NULL && job->output->keep))
+				continue;
+			if (job->cache == NULL || job->cache->pixels == NULL)
+				return 0;
+		}
+	return 1;
+}
+
+/*
+ * Tells every buffer on which outputs and in which modes it will be
+ * shown, which allows decoders to skip work that would be discarded.
+ * Buffers are decoded for all of their outputs unless every one of
+ * them is found in the cache, because keys of cache entries depend
+ * on the decoding.
+ */
+void
+plan_buffers(wp_config_t *config, wp_plan_t *plans, size_t count)
+{
+	wp_option_t *opt;
+	size_t i, j;
+
+	for (opt = config->options; opt != NULL && opt->filename != NULL;
+	    opt++)
+		opt->buffer->count = 0;
+
+	for (i = 0; i < count; i++)
+		for (j = 0; j < plans[i].count; j++) {
+			wp_job_t *job = &plans[i].jobs[j];
+			wp_target_t target;
+
+			/* kept outputs need no pixels at all */
+			if (job->output != NULL && job->output->keep)
+				continue;
+
+			target = (wp_target_t){
+				.mode = job->option->mode,
+				.trim = job->option->trim
+			};
+			if (plans[i].outputs != NULL) {
+				target.width = job->output->width;
+				target.height = job->output->height;
+			} else {
+				/* tiles always need full resolution */
+				target.mode = MODE_TILE;
+				target.width = 1;
+				target.height = 1;
+			}
+			add_target(job->option->buffer, target);
+		}
+
+	for (opt = config->options; opt != NULL && opt->filename != NULL;
+	    opt++)
+		if (opt->buffer->count != 0 &&
+		    is_cached(opt->buffer, plans, count))
+			opt->buffer->count = 0;
+}
+
+/*
+ * Looks up cache entries of all jobs of a screen.  Keys depend on the
+ * decoding of images, so plan_buffers has to be called first and again
+ * afterwards to skip images which are not needed anymore.
+ */
+void
+plan_cache(xcb_screen_t *screen, wp_plan_t *plan)
+{
+	size_t i;
+
+	for (i = 0; i < plan->count; i++)
+		if (plan->jobs[i].output == NULL ||
+		    !plan->jobs[i].output->keep)
+			plan->jobs[i].cache = lookup_cache(screen,
+			    &plan->jobs[i]);
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2025 Tobias Stoeckmann <tobias@stoeckmann.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <err.h>
+#include <pixman.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "functions.h"
+
+/*
+ * Averages four pixels with 8 bit channels.  Two channels are summed
+ * at once in 16 bit lanes of a 32 bit word, which cannot overflow.
+ */
+static inline uint32_t
+average(uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+	uint32_t even, odd;
+
+	even = (a & 0x00ff00ff) + (b & 0x00ff00ff) + (c & 0x00ff00ff) +
+	    (d & 0x00ff00ff) + 0x00020002;
+	odd = ((a >> 8) & 0x00ff00ff) + ((b >> 8) & 0x00ff00ff) +
+	    ((c >> 8) & 0x00ff00ff) + ((d >> 8) & 0x00ff00ff) + 0x00020002;
+
+	return ((even >> 2) & 0x00ff00ff) | ((odd << 6) & 0xff00ff00);
+}
+
+/*
+ * Calculates the region of an image which is halved with halve_image.
+ */
+void
+halve_region(wp_box_t *region)
+{
+	*region = (wp_box_t){
+		.x_off = region->x_off / 2,
+		.y_off = region->y_off / 2,
+		.width = (region->x_off + region->width + 1) / 2 -
+		    region->x_off / 2,
+		.height = (region->y_off + region->height + 1) / 2 -
+		    region->y_off / 2
+	};
+}
+
+/*
+ * Halves an image with 32 bit pixels in both directions by averaging
+ * blocks of 2x2 pixels.  Blocks are aligned to even coordinates of the
+ * whole image.  Region is the position of img within the whole image
+ * and is updated for the new image.  Returns NULL if the format is not
+ * supported.
+ *
+ * Blocks at the edges of region lack pixels, which are replaced by
+ * their neighbours, so only existing pixels are averaged.
+ */
+pixman_image_t *
+halve_image(pixman_image_t *img, wp_box_t *region)
+{
+	pixman_image_t *half;
+	pixman_format_code_t format;
+	uint32_t *pixels, *p, *src, *r0, *r1;
+	size_t len;
+	int height, stride, width, x, x0, x1, y, y0, y1;
+	wp_box_t box;
+
+	format = pixman_image_get_format(img);
+	if (format != PIXMAN_a8r8g8b8 && format != PIXMAN_x8r8g8b8)
+		return NULL;
+
+	src = pixman_image_get_data(img);
+	stride = pixman_image_get_stride(img) / sizeof(*src);
+	width = region->width;
+	height = region->height;
+
+	box = *region;
+	halve_region(&box);
+
+	SAFE_MUL3(len, box.width, box.height, sizeof(*pixels));
+	p = pixels = xmalloc(len);
+	for (y = 0; y < box.height; y++) {
+		y0 = (box.y_off + y) * 2 - region->y_off;
+		y1 = y0 + 1;
+		if (y0 < 0)
+			y0 = y1;
+		if (y1 >= height)
+			y1 = y0;
+		r0 = src + (size_t)y0 * stride;
+		r1 = src + (size_t)y1 * stride;
+		for (x = 0; x < box.width; x++) {
+			x0 = (box.x_off + x) * 2 - region->x_off;
+			x1 = x0 + 1;
+			if (x0 < 0)
+				x0 = x1;
+			if (x1 >= width)
+				x1 = x0;
+			*p++ = average(r0[x0], r0[x1], r1[x0], r1[x1]);
+		}
+	}
+
+	half = pixman_image_create_bits(format, box.width, box.height,
+	    pixels, box.width * sizeof(*pixels));
+	if (half == NULL)
+		errx(1, "failed to create pixman image");
+	pixman_image_set_destroy_function(half, free_pixels, pixels);
+
+	*region = box;
+	return half;
+}
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2025 Tobias Stoeckmann <tobias@stoeckmann.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <xcb/xcb.h>
+#include <xcb/render.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "functions.h"
+
+static int has_render = -1;
+static xcb_render_query_pict_formats_reply_t *formats;
+/* picture format of uploaded source images */
+static xcb_render_pictformat_t argb_format;
+
+static int
+check_render(xcb_connection_t *c)
+{
+	const xcb_query_extension_reply_t *ext;
+	xcb_render_query_version_reply_t *reply;
+	xcb_render_pictforminfo_t *info;
+	int i, len, ok;
+
+	ext = xcb_get_extension_data(c, &xcb_render_id);
+	if (ext == NULL || !ext->present) {
+		debug("RENDER is not available\n");
+		return 0;
+	}
+
+	/* transforms and filters exist since version 0.6 */
+	reply = xcb_render_query_version_reply(c,
+	    xcb_render_query_version(c, 0, 11), NULL);
+	ok = reply != NULL && (reply->major_version > 0 ||
+	    reply->minor_version >= 6);
+	if (reply != NULL)
+		debug("RENDER version %u.%u%s\n", reply->major_version,
+		    reply->minor_version, ok ? "" : " is too old");
+	free(reply);
+	if (!ok)
+		return 0;
+
+	formats = xcb_render_query_pict_formats_reply(c,
+	    xcb_render_query_pict_formats(c), NULL);
+	if (formats == NULL)
+		return 0;
+
+	info = xcb_render_query_pict_formats_formats(formats);
+	len = xcb_render_query_pict_formats_formats_length(formats);
+	for (i = 0; i < len; i++)
+		if (info[i].type == XCB_RENDER_PICT_TYPE_DIRECT &&
+		    info[i].depth == 32 &&
+		    info[i].direct.alpha_shift == 24 &&
+		    info[i].direct.alpha_mask == 0xff &&
+		    info[i].direct.red_shift == 16 &&
+		    info[i].direct.red_mask == 0xff &&
+		    info[i].direct.green_shift == 8 &&
+		    info[i].direct.green_mask == 0xff &&
+		    info[i].direct.blue_shift == 0 &&
+		    info[i].direct.blue_mask == 0xff) {
+			argb_format = info[i].id;
+			return 1;
+		}
+
+	debug("RENDER lacks 32 bit ARGB format\n");
+	free(formats);
+	formats = NULL;
+	return 0;
+}
+
+static xcb_render_pictformat_t
+find_visual_format(xcb_visualid_t visual)
+{
+	xcb_render_pictscreen_iterator_t screens;
+	xcb_render_pictdepth_iterator_t depths;
+	xcb_render_pictvisual_t *visuals;
+	int i, len;
+
+	screens = xcb_render_query_pict_formats_screens_iterator(formats);
+	for (; screens.rem; xcb_render_pictscreen_next(&screens)) {
+		depths = xcb_render_pictscreen_depths_iterator(screens.data);
+		for (; depths.rem; xcb_render_pictdepth_next(&depths)) {
+			visuals = xcb_render_pictdepth_visuals(depths.data);
+			len = xcb_render_pictdepth_visuals_length(depths.data);
+			for (i = 0; i < len; i++)
+				if (visuals[i].visual == visual)
+					return visuals[i].format;
+		}
+	}
+	return XCB_NONE;
+}
+
+/*
+ * Returns 1 if the X server is able to scale images into pixmaps of
+ * screen with RENDER.
+ */
+int
+init_render(xcb_connection_t *c, xcb_screen_t *screen)
+{
+	if (has_render == -1)
+		has_render = check_render(c);
+	return has_render &&
+	    find_visual_format(screen->root_visual) != XCB_NONE;
+}
+
+/*
+ * Creates a picture of a 32 bit pixmap, which contains a8r8g8b8
+ * pixels of a source image.
+ */
+uint32_t
+create_picture(xcb_connection_t *c, xcb_pixmap_t pixmap)
+{
+	xcb_render_picture_t picture;
+
+	picture = xcb_generate_id(c);
+	xcb_render_create_picture(c, picture, pixmap, argb_format, 0, NULL);
+	return picture;
+}
+
+void
+free_picture(xcb_connection_t *c, uint32_t picture)
+{
+	xcb_render_free_picture(c, picture);
+}
+
+/*
+ * Lets the X server draw source picture on area of output, using the
+ * same transform and filter as pixman would on client side.
+ */
+void
+scale_picture(xcb_connection_t *c, xcb_screen_t *screen, uint32_t picture,
+    xcb_pixmap_t pixmap, wp_output_t *output, wp_output_t *area,
+    pixman_transform_t *transform, pixman_filter_t filter)
+{
+	xcb_render_picture_t dest;
+	xcb_render_transform_t matrix;
+	const char *name;
+
+	matrix = (xcb_render_transform_t){
+		.matrix11 = transform->matrix[0][0],
+		.matrix12 = transform->matrix[0][1],
+		.matrix13 = transform->matrix[0][2],
+		.matrix21 = transform->matrix[1][0],
+		.matrix22 = transform->matrix[1][1],
+		.matrix23 = transform->matrix[1][2],
+		.matrix31 = transform->matrix[2][0],
+		.matrix32 = transform->matrix[2][1],
+		.matrix33 = transform->matrix[2][2]
+	};
+
+	switch (filter) {
+	case PIXMAN_FILTER_FAST:
+		name = "fast";
+		break;
+	case PIXMAN_FILTER_NEAREST:
+		name = "nearest";
+		break;
+	case PIXMAN_FILTER_GOOD:
+		name = "good";
+		break;
+	default:
+		name = "best";
+		break;
+	}
+	xcb_render_set_picture_transform(c, picture, matrix);
+	xcb_render_set_picture_filter(c, picture, strlen(name), name, 0, NULL);
+
+	dest = xcb_generate_id(c);
+	xcb_render_create_picture(c, dest, pixmap,
+	    find_visual_format(screen->root_visual), 0, NULL);
+	debug("scaling (filter %s) for %s (area %dx%d+%d+%d) on server side\n",
+	    name, output->name, area->width, area->height,
+	    area->x - output->x, area->y - output->y);
+	/* transform maps coordinates relative to output */
+	xcb_render_composite(c, XCB_RENDER_PICT_OP_SRC, picture, XCB_NONE,
+	    dest, area->x - output->x, area->y - output->y, 0, 0, area->x,
+	    area->y, area->width, area->height);
+	xcb_render_free_picture(c, dest);
+}
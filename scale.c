@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2025 Tobias Stoeckmann <tobias@stoeckmann.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <pixman.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "functions.h"
+
+/* rounds towards negative infinity, unlike the division operator */
+static inline int
+floordiv(int a, int b)
+{
+	return a >= 0 ? a / b : -((b - 1 - a) / b);
+}
+
+/*
+ * Repeats every source pixel factor times in both directions.  Rows
+ * showing the same source row as the previous one are copied.
+ */
+static void
+enlarge(uint32_t *dest, size_t dest_stride, const uint32_t *src,
+    size_t src_stride, int src_width, int src_height, int factor,
+    int x, int y, int width, int height)
+{
+	const uint32_t *s;
+	uint32_t *d;
+	int i, j, rem, sx, sy, last;
+
+	last = -1;
+	for (j = 0; j < height; j++) {
+		d = dest + (size_t)j * dest_stride;
+		sy = floordiv(y + j, factor);
+		if (sy < 0 || sy >= src_height) {
+			memset(d, 0, (size_t)width * sizeof(*d));
+			last = -1;
+			continue;
+		}
+		if (sy == last) {
+			memcpy(d, d - dest_stride, (size_t)width * sizeof(*d));
+			continue;
+		}
+		last = sy;
+
+		s = src + (size_t)sy * src_stride;
+		sx = floordiv(x, factor);
+		rem = x - sx * factor;
+		for (i = 0; i < width; i++) {
+			d[i] = sx >= 0 && sx < src_width ? s[sx] : 0;
+			if (++rem == factor) {
+				rem = 0;
+				sx++;
+			}
+		}
+	}
+}
+
+/*
+ * Averages blocks of factor x factor pixels, with factor being 2 or 4.
+ * Two channels are summed at once in 16 bit lanes of a 32 bit word,
+ * which cannot overflow with up to 16 pixels.  Pixels outside of the
+ * source are transparent black, just like pixman samples them.
+ */
+static void
+shrink(uint32_t *dest, size_t dest_stride, const uint32_t *src,
+    size_t src_stride, int src_width, int src_height, int factor,
+    int x, int y, int width, int height)
+{
+	const uint32_t *s;
+	uint32_t *d, even, odd, p, round;
+	int i, j, m, n, shift, sx, sy;
+
+	shift = factor == 2 ? 2 : 4;
+	round = UINT32_C(0x00010001) << (shift - 1);
+	for (j = 0; j < height; j++) {
+		d = dest + (size_t)j * dest_stride;
+		for (i = 0; i < width; i++) {
+			even = odd = round;
+			for (n = 0; n < factor; n++) {
+				sy = y + j * factor + n;
+				if (sy < 0 || sy >= src_height)
+					continue;
+				s = src + (size_t)sy * src_stride;
+				for (m = 0; m < factor; m++) {
+					sx = x + i * factor + m;
+					if (sx < 0 || sx >= src_width)
+						continue;
+					p = s[sx];
+					even += p & 0x00ff00ff;
+					odd += (p >> 8) & 0x00ff00ff;
+				}
+			}
+			d[i] = ((even >> shift) & 0x00ff00ff) |
+			    ((odd << (8 - shift)) & 0xff00ff00);
+		}
+	}
+}
+
+/*
+ * Scales src by an integer factor into width x height pixels of dest,
+ * starting at row dest_y.  Both images must have 8 bit channels in 32
+ * bit pixels.
+ *
+ * A positive factor enlarges without interpolation, so column i shows
+ * source column (x + i) / factor, rounded down.  A negative factor of
+ * -2 or -4 reduces by averaging blocks, column i starting at source
+ * column x + i * -factor.  Rows are located by y in the same way.
+ */
+void
+scale_band(pixman_image_t *dest, int dest_y, pixman_image_t *src,
+    int factor, int x, int y, int width, int height)
+{
+	uint32_t *d, *s;
+	size_t dest_stride, src_stride;
+	int src_height, src_width;
+
+	d = pixman_image_get_data(dest);
+	dest_stride = pixman_image_get_stride(dest) / sizeof(*d);
+	d += (size_t)dest_y * dest_stride;
+	s = pixman_image_get_data(src);
+	src_stride = pixman_image_get_stride(src) / sizeof(*s);
+	src_width = pixman_image_get_width(src);
+	src_height = pixman_image_get_height(src);
+
+	if (factor > 0)
+		enlarge(d, dest_stride, s, src_stride, src_width, src_height,
+		    factor, x, y, width, height);
+	else
+		shrink(d, dest_stride, s, src_stride, src_width, src_height,
+		    -factor, x, y, width, height);
+}
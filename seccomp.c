@@ -45,6 +45,10 @@ add_common_stage2_rules(scmp_filter_ctx ctx)
 	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(brk), 0) ||
 	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(clock_getres), 0) ||
 	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(clock_gettime), 0) ||
+#ifdef __NR_clock_gettime64
+	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(clock_gettime64),
+	    0) ||
+#endif
 	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(close), 0) ||
 	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(dup), 0) ||
 	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(dup2), 0) ||
@@ -83,10 +87,6 @@ add_common_stage2_rules(scmp_filter_ctx ctx)
 	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(getsid), 0) ||
 	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(gettimeofday), 0) ||
 	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(getuid), 0) ||
-	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(lseek), 0) ||
-#ifdef __NR__llseek
-	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(_llseek), 0) ||
-#endif
 	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(madvise), 0) ||
 #ifdef __NR_mmap
 	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(mmap), 0) ||
@@ -162,6 +162,11 @@ stage1_sandbox(void)
 	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(getsockname), 0) ||
 	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(getsockopt), 0) ||
 	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(setsockopt), 0) ||
+	    /* pledge: cpath for cache directory */
+#ifdef __NR_mkdir
+	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(mkdir), 0) ||
+#endif
+	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(mkdirat), 0) ||
 	    /* pledge: rpath */
 	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(chdir), 0) ||
 	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(chmod), 0) ||
@@ -176,6 +181,11 @@ stage1_sandbox(void)
 	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(fchown), 0) ||
 	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(fchownat), 0) ||
 	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(getcwd), 0) ||
+	    /* files are mapped, no stdio seeking after stage 1 */
+	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(lseek), 0) ||
+#ifdef __NR__llseek
+	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(_llseek), 0) ||
+#endif
 	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(lstat), 0) ||
 #ifdef __NR_open
 	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(open), 0) ||
@@ -188,6 +198,14 @@ stage1_sandbox(void)
 	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(clone), 0) ||
 	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(set_robust_list), 0) ||
 	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(setsid), 0) ||
+#ifdef __NR_clone3
+	    /* threads: let libc fall back from clone3 to clone */
+	    seccomp_rule_add(ctx, SCMP_ACT_ERRNO(ENOSYS), SCMP_SYS(clone3),
+	    0) ||
+#endif
+#ifdef __NR_rseq
+	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(rseq), 0) ||
+#endif
 	    /* seccomp for stage 2 */
 	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(seccomp), 0) ||
 	    add_common_stage2_rules(ctx) ||
@@ -196,8 +214,29 @@ stage1_sandbox(void)
 	seccomp_release(ctx);
 }
 
+static int
+add_cache_rules(scmp_filter_ctx ctx, int fd)
+{
+	/* pledge: rpath wpath cpath fattr, relative to cache directory */
+	return seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(getdents64), 0) ||
+	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(openat), 1,
+	    SCMP_A0(SCMP_CMP_EQ, fd)) ||
+#ifdef __NR_renameat
+	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(renameat), 2,
+	    SCMP_A0(SCMP_CMP_EQ, fd), SCMP_A2(SCMP_CMP_EQ, fd)) ||
+#endif
+#ifdef __NR_renameat2
+	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(renameat2), 2,
+	    SCMP_A0(SCMP_CMP_EQ, fd), SCMP_A2(SCMP_CMP_EQ, fd)) ||
+#endif
+	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(unlinkat), 1,
+	    SCMP_A0(SCMP_CMP_EQ, fd)) ||
+	    seccomp_rule_add(ctx, SCMP_ACT_ALLOW, SCMP_SYS(utimensat), 1,
+	    SCMP_A0(SCMP_CMP_EQ, fd));
+}
+
 void
-stage2_sandbox(void)
+stage2_sandbox(int cache_fd)
 {
 	scmp_filter_ctx ctx;
 
@@ -208,6 +247,9 @@ stage2_sandbox(void)
 
 	ctx = seccomp_init(SCMP_ACT_KILL);
 	if (ctx == NULL || add_common_stage2_rules(ctx) ||
+	    /* worker threads already exist */
+	    seccomp_attr_set(ctx, SCMP_FLTATR_CTL_TSYNC, 1) ||
+	    (cache_fd != -1 && add_cache_rules(ctx, cache_fd)) ||
 #if defined (WITH_JPEG) && defined(__linux__) && (defined(__aarch64__) || \
     defined(__arm__) || defined(__mips__) || defined(__powerpc64__) || \
     defined(__powerpc__))
@@ -216,7 +258,10 @@ stage2_sandbox(void)
 	     * deny the access with error instead of termination.
 	     */
 	    seccomp_rule_add(ctx, SCMP_ACT_ERRNO(1), SCMP_SYS(open), 0) ||
-	    seccomp_rule_add(ctx, SCMP_ACT_ERRNO(1), SCMP_SYS(openat), 0) ||
+	    (cache_fd == -1 ?
+	    seccomp_rule_add(ctx, SCMP_ACT_ERRNO(1), SCMP_SYS(openat), 0) :
+	    seccomp_rule_add(ctx, SCMP_ACT_ERRNO(1), SCMP_SYS(openat), 1,
+	    SCMP_A0(SCMP_CMP_NE, cache_fd))) ||
 #endif /* WITH_JPEG and /proc/cpuinfo */
 	    seccomp_load(ctx))
 		err(1, "failed to set up stage 2 seccomp");
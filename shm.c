@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2025 Tobias Stoeckmann <tobias@stoeckmann.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <sys/mman.h>
+
+#include <xcb/xcb.h>
+#include <xcb/shm.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "functions.h"
+
+static int has_shm = -1;
+
+static int
+check_shm(xcb_connection_t *c)
+{
+	const xcb_query_extension_reply_t *ext;
+	xcb_shm_query_version_reply_t *reply;
+	int ok;
+
+	ext = xcb_get_extension_data(c, &xcb_shm_id);
+	if (ext == NULL || !ext->present) {
+		debug("MIT-SHM is not available\n");
+		return 0;
+	}
+
+	/* segments are created by the server since version 1.2 */
+	reply = xcb_shm_query_version_reply(c, xcb_shm_query_version(c), NULL);
+	ok = reply != NULL && (reply->major_version > 1 ||
+	    (reply->major_version == 1 && reply->minor_version >= 2));
+	if (reply != NULL)
+		debug("MIT-SHM version %u.%u%s\n", reply->major_version,
+		    reply->minor_version, ok ? "" : " is too old");
+	free(reply);
+
+	return ok;
+}
+
+/*
+ * Returns memory which is shared with the X server, or NULL if the
+ * image has to be sent through the connection instead.
+ */
+void *
+create_shm(xcb_connection_t *c, size_t len, uint32_t *seg)
+{
+	xcb_shm_create_segment_cookie_t cookie;
+	xcb_shm_create_segment_reply_t *reply;
+	xcb_shm_seg_t id;
+	void *addr;
+	int *fds;
+
+	if (has_shm == -1)
+		has_shm = check_shm(c);
+	if (!has_shm || len > UINT32_MAX)
+		return NULL;
+
+	id = xcb_generate_id(c);
+	cookie = xcb_shm_create_segment(c, id, len, 0);
+	reply = xcb_shm_create_segment_reply(c, cookie, NULL);
+	if (reply == NULL) {
+		/* remote connections cannot pass file descriptors */
+		debug("failed to create shared memory segment\n");
+		has_shm = 0;
+		return NULL;
+	}
+
+	addr = MAP_FAILED;
+	fds = xcb_shm_create_segment_reply_fds(c, reply);
+	if (reply->nfd == 1) {
+		addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    fds[0], 0);
+		close(fds[0]);
+	}
+	free(reply);
+
+	if (addr == MAP_FAILED) {
+		debug("failed to map shared memory segment\n");
+		xcb_shm_detach(c, id);
+		has_shm = 0;
+		return NULL;
+	}
+
+	debug("created shared memory segment of %zu bytes\n", len);
+	*seg = id;
+
+	return addr;
+}
+
+void
+free_shm(xcb_connection_t *c, void *addr, size_t len, uint32_t seg)
+{
+	/* round trip guarantees that server has finished reading */
+	xcb_request_check(c, xcb_shm_detach_checked(c, seg));
+	if (munmap(addr, len))
+		err(1, "failed to unmap shared memory segment");
+}
+
+void
+put_shm(xcb_connection_t *c, xcb_screen_t *screen, wp_output_t *output,
+    xcb_pixmap_t pixmap, xcb_gcontext_t gc, uint32_t seg)
+{
+	debug("shm put image (%dx%d) to %s (%dx%d+%d+%d)\n",
+	    output->width, output->height,
+	    output->name != NULL ? output->name : "screen", output->width,
+	    output->height, output->x, output->y);
+	xcb_shm_put_image(c, pixmap, gc, output->width, output->height,
+	    0, 0, output->width, output->height, output->x, output->y,
+	    screen->root_depth, XCB_IMAGE_FORMAT_Z_PIXMAP, 0, seg, 0);
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2025 Tobias Stoeckmann <tobias@stoeckmann.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <err.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "functions.h"
+
+typedef struct wp_pool {
+	pthread_mutex_t	  mutex;
+	pthread_cond_t	  work;
+	pthread_cond_t	  done;
+	void		(*fn)(void *, size_t);
+	void		 *arg;
+	size_t		  next;
+	size_t		  count;
+	/* tasks from this index on are not released yet */
+	size_t		  limit;
+	/* lowest task index which is not finished yet */
+	size_t		  finished;
+	uint8_t		 *flags;
+	size_t		  size;
+	unsigned int	  threads;
+} wp_pool_t;
+
+static wp_pool_t pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+	.threads = 1
+};
+
+/*
+ * Runs next task of current batch.
+ * Must be called with locked mutex.
+ */
+static void
+run_task(void)
+{
+	size_t i;
+
+	i = pool.next++;
+	pthread_mutex_unlock(&pool.mutex);
+	pool.fn(pool.arg, i);
+	pthread_mutex_lock(&pool.mutex);
+
+	pool.flags[i] = 1;
+	if (i == pool.finished) {
+		while (pool.finished < pool.count &&
+		    pool.flags[pool.finished])
+			pool.finished++;
+		pthread_cond_broadcast(&pool.done);
+	}
+}
+
+static void *
+worker(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&pool.mutex);
+	for (;;) {
+		while (pool.next >= pool.limit)
+			pthread_cond_wait(&pool.work, &pool.mutex);
+		run_task();
+	}
+	/* NOTREACHED */
+	return NULL;
+}
+
+unsigned int
+get_threads(void)
+{
+	return pool.threads;
+}
+
+void
+init_threads(unsigned int threads)
+{
+	pthread_t thread;
+	long n;
+
+	if (threads == 0) {
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = n < 1 ? 1 : n > MAX_THREADS ? MAX_THREADS : n;
+	}
+
+	debug("using %u thread%s\n", threads, threads == 1 ? "" : "s");
+
+	/* calling thread takes part in all batches */
+	for (pool.threads = 1; pool.threads < threads; pool.threads++) {
+		if (pthread_create(&thread, NULL, worker, NULL) != 0) {
+			warnx("failed to create thread");
+			break;
+		}
+		pthread_detach(thread);
+	}
+}
+
+/*
+ * Hands a batch of tasks to the worker threads, of which only the
+ * first limit ones may run for now.  The previous batch must have
+ * been waited for.
+ *
+ * Tasks report fatal errors like the main thread does, through err or
+ * errx, which terminate the whole process from any thread.
+ */
+void
+start_tasks(void (*fn)(void *, size_t), void *arg, size_t count,
+    size_t limit)
+{
+	pthread_mutex_lock(&pool.mutex);
+	if (count > pool.size) {
+		free(pool.flags);
+		pool.flags = xmalloc(count);
+		pool.size = count;
+	}
+	if (count != 0)
+		memset(pool.flags, 0, count);
+	pool.fn = fn;
+	pool.arg = arg;
+	pool.next = 0;
+	pool.count = count;
+	pool.limit = limit < count ? limit : count;
+	pool.finished = 0;
+	if (pool.threads > 1 && pool.limit > 1)
+		pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.mutex);
+}
+
+/*
+ * Allows tasks of current batch up to limit to run.
+ */
+void
+release_tasks(size_t limit)
+{
+	pthread_mutex_lock(&pool.mutex);
+	if (limit > pool.count)
+		limit = pool.count;
+	if (limit > pool.limit) {
+		pool.limit = limit;
+		if (pool.threads > 1)
+			pthread_cond_broadcast(&pool.work);
+	}
+	pthread_mutex_unlock(&pool.mutex);
+}
+
+/*
+ * Waits until the first n tasks of current batch are finished and
+ * helps out with outstanding tasks in the meantime.  These tasks must
+ * have been released.
+ */
+void
+wait_tasks(size_t n)
+{
+	pthread_mutex_lock(&pool.mutex);
+	while (pool.finished < n) {
+		if (pool.next < n && pool.next < pool.limit)
+			run_task();
+		else
+			pthread_cond_wait(&pool.done, &pool.mutex);
+	}
+	pthread_mutex_unlock(&pool.mutex);
+}
+
+void
+run_tasks(void (*fn)(void *, size_t), void *arg, size_t count)
+{
+	start_tasks(fn, arg, count, count);
+	wait_tasks(count);
+}
@@ -15,6 +15,7 @@
  */
 
 #include <err.h>
+#include <pixman.h>
 #include <stdlib.h>
 
 void *
@@ -29,3 +30,10 @@ xmalloc(size_t n)
 		err(1, "failed to allocate memory");
 	return p;
 }
+
+void
+free_pixels(pixman_image_t *img, void *data)
+{
+	(void)img;
+	free(data);
+}